@@ -0,0 +1,371 @@
+// Microbenchmarks for the shell's hot paths: parsing, command lookup, tab
+// completion, starting commands and moving data through pipelines.
+//
+// Usage: shell_bench [filter]
+//
+// Only benchmarks whose name contains filter are run. Each one reports the
+// time and heap allocations per operation, and the lexer's large-line cases
+// their throughput too; the pipe benchmarks report throughput and context
+// switches per stage instead.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "shell.h"
+
+#define BENCH_MIN_NS 200000000LL     // Run each benchmark for at least this long
+#define BENCH_DIR_ENTRIES 5000       // Executables in the completion directory
+#define BENCH_PATH_DIRS 100          // Missing directories in the long PATH
+#define PIPE_BENCH_BYTES (128L << 20)
+
+// glibc's allocator, under the names it exports next to malloc
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void *ptr, size_t size);
+
+// Heap allocations this process has made, counted by the functions below
+unsigned long allocation_count = 0;
+
+// Benchmarks to run, by substring of their name (NULL runs all)
+const char *bench_filter = NULL;
+
+// Interposed over libc's malloc, so allocations made by the shell (and by
+// libc on its behalf, as in strdup) are counted
+void* malloc(size_t size) {
+    allocation_count++;
+    return __libc_malloc(size);
+}
+
+// Interposed over libc's calloc (see malloc)
+void* calloc(size_t count, size_t size) {
+    allocation_count++;
+    return __libc_calloc(count, size);
+}
+
+// Interposed over libc's realloc (see malloc). Growing a buffer counts as an
+// allocation; freeing through realloc(ptr, 0) does too, which the shell never does.
+void* realloc(void *ptr, size_t size) {
+    allocation_count++;
+    return __libc_realloc(ptr, size);
+}
+
+// Function to check whether a benchmark was selected on the command line
+int bench_selected(const char *name) {
+    return !bench_filter || strstr(name, bench_filter) != NULL;
+}
+
+// Function to time an operation that processes bytes bytes of input (0 if
+// throughput means nothing for it). The iteration count doubles until one
+// batch takes BENCH_MIN_NS; that batch is reported.
+void run_throughput_benchmark(const char *name, void (*op)(void *), void *arg, size_t bytes) {
+    if (!bench_selected(name)) {
+        return;
+    }
+    
+    op(arg);  // Warm up caches and the shell's own tables
+    
+    long iterations = 1;
+    while (1) {
+        unsigned long allocations = allocation_count;
+        long long start = monotonic_ns();
+        for (long i = 0; i < iterations; i++) {
+            op(arg);
+        }
+        long long elapsed = monotonic_ns() - start;
+        allocations = allocation_count - allocations;
+        
+        if (elapsed >= BENCH_MIN_NS || iterations >= (1L << 30)) {
+            printf("%-36s %10ld %14.1f ns/op %10.2f allocs/op", name, iterations,
+                   (double)elapsed / iterations, (double)allocations / iterations);
+            if (bytes > 0) {
+                printf(" %10.1f MB/s", (double)bytes * iterations / 1e6 / (elapsed / 1e9));
+            }
+            printf("\n");
+            fflush(stdout);
+            return;
+        }
+        iterations *= 2;
+    }
+}
+
+// Function to time an operation, reporting time and allocations per op
+void run_benchmark(const char *name, void (*op)(void *), void *arg) {
+    run_throughput_benchmark(name, op, arg, 0);
+}
+
+// Function to parse one line and release what was parsed from it
+void bench_parse(void *arg) {
+    CommandList *list = parse_command_list(arg);
+    if (!list) {
+        fprintf(stderr, "shell_bench: benchmark line failed to parse\n");
+        exit(1);
+    }
+    arena_reset(&line_arena);
+}
+
+// Function to split a line into runs of ordinary word characters, as the
+// lexer's scan does, without building any words
+void bench_scan(void *arg) {
+    const char *p = arg;
+    const char *end = p + strlen(p);
+    while (p < end) {
+        p = scan_word_chars(p, end);
+        if (p < end) p++;
+    }
+}
+
+// Function to look a command up through the hash table
+void bench_lookup(void *arg) {
+    free(find_executable(arg));
+}
+
+// Function to look a command up with an empty hash table, so PATH is searched
+void bench_lookup_cold(void *arg) {
+    hash_flush();
+    free(find_executable(arg));
+}
+
+// Function to list every completion for a prefix, as a Tab press does
+void bench_complete(void *arg) {
+    char *match;
+    for (int state = 0; (match = command_generator(arg, state)) != NULL; state++) {
+        free(match);
+    }
+}
+
+// Function to rebuild the completion index from scratch. PATH alternates
+// between two spellings of the same directory so every call rescans it.
+void bench_complete_rebuild(void *arg) {
+    char **paths = arg;
+    const char *path = get_variable("PATH");
+    set_variable("PATH", path && strcmp(path, paths[0]) == 0 ? paths[1] : paths[0], 1);
+    refresh_completion_index();
+}
+
+// Function to run one command line the way the shell runs typed input
+void bench_run_line(void *arg) {
+    char *line = strdup(arg);
+    run_line(line);
+    free(line);
+    if (last_status != 0) {
+        fprintf(stderr, "shell_bench: '%s' exited with %d\n", (char *)arg, last_status);
+        exit(1);
+    }
+}
+
+// Function to build a line of count copies of word, separated by spaces
+char* repeat_words(const char *prefix, const char *word, int count) {
+    size_t len = strlen(prefix) + (size_t)count * (strlen(word) + 1) + 1;
+    char *line = malloc(len);
+    if (!line) {
+        perror("malloc failed");
+        exit(1);
+    }
+    
+    char *p = stpcpy(line, prefix);
+    for (int i = 0; i < count; i++) {
+        *p++ = ' ';
+        p = stpcpy(p, word);
+    }
+    return line;
+}
+
+// Function to create a directory holding count empty executables, for the
+// completion benchmarks. Returns its path.
+char* make_bench_dir(int count) {
+    char template[] = "/tmp/shell_bench.XXXXXX";
+    char *dir = mkdtemp(template);
+    if (!dir) {
+        perror("mkdtemp failed");
+        exit(1);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s/cmd%05d", dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+        if (fd == -1) {
+            fprintf(stderr, "shell_bench: %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        close(fd);
+    }
+    return strdup(dir);
+}
+
+// Function to remove a directory made by make_bench_dir
+void remove_bench_dir(char *dir, int count) {
+    for (int i = 0; i < count; i++) {
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s/cmd%05d", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+    free(dir);
+}
+
+// Function to benchmark the lexer and parser on small and huge lines. The
+// huge ones report bytes of line parsed per second.
+void run_parse_benchmarks(void) {
+    run_benchmark("parse_pipeline/small", bench_parse, "ls -l /tmp | grep foo | wc -l");
+    run_benchmark("parse_pipeline/quoted", bench_parse,
+                  "echo \"hello $HOME\" 'single quoted' back\\ slash | tr a-z A-Z; true &");
+    
+    char *huge = repeat_words("echo", "argument", 100000);
+    run_throughput_benchmark("parse_pipeline/huge", bench_parse, huge, strlen(huge));
+    
+    // The lexer's scan alone: short words, one long word, and a typical line
+    size_t huge_len = strlen(huge);
+    run_throughput_benchmark("scan_word_chars/short-words", bench_scan, huge, huge_len);
+    memset(huge, 'a', huge_len);
+    run_throughput_benchmark("scan_word_chars/long-word", bench_scan, huge, huge_len);
+    const char *typical = "ls -l /tmp/some/where | grep foo | wc -l";
+    run_throughput_benchmark("scan_word_chars/typical-line", bench_scan, (void *)typical, strlen(typical));
+    free(huge);
+    
+    char *stages = repeat_words("true", "| cat", 1000);
+    run_benchmark("parse_pipeline/1000-stages", bench_parse, stages);
+    free(stages);
+    
+    run_benchmark("parse_redirection/small", bench_parse, "sort < in.txt > out.txt 2>&1");
+    char *redirs = repeat_words("cat", "<in >>out 2>&1 3<>rw 4>&-", 20000);
+    run_throughput_benchmark("parse_redirection/huge", bench_parse, redirs, strlen(redirs));
+    free(redirs);
+}
+
+// Function to benchmark command lookup with a PATH whose first entries don't exist
+void run_lookup_benchmarks(void) {
+    const char *saved = get_variable("PATH");
+    char *original = strdup(saved ? saved : "/usr/bin:/bin");
+    
+    run_benchmark("find_executable/hashed", bench_lookup, "ls");
+    run_benchmark("find_executable/short-path", bench_lookup_cold, "ls");
+    
+    char long_path[MAX_PATH_LENGTH];
+    size_t len = 0;
+    for (int i = 0; i < BENCH_PATH_DIRS; i++) {
+        len += snprintf(long_path + len, sizeof(long_path) - len, "/no/d%02d:", i);
+    }
+    snprintf(long_path + len, sizeof(long_path) - len, "%s", original);
+    set_variable("PATH", long_path, 1);
+    run_benchmark("find_executable/long-path", bench_lookup_cold, "ls");
+    run_benchmark("find_executable/long-path-missing", bench_lookup_cold, "no-such-command");
+    
+    hash_flush();
+    set_variable("PATH", original, 1);
+    free(original);
+}
+
+// Function to benchmark tab completion over a large directory
+void run_completion_benchmarks(void) {
+    if (!bench_selected("complete")) {
+        return;
+    }
+    
+    const char *saved = get_variable("PATH");
+    char *original = strdup(saved ? saved : "/usr/bin:/bin");
+    char *dir = make_bench_dir(BENCH_DIR_ENTRIES);
+    
+    char *paths[2];
+    paths[0] = strdup(dir);
+    if (asprintf(&paths[1], "%s:", dir) == -1) {
+        perror("asprintf failed");
+        exit(1);
+    }
+    run_benchmark("complete/rebuild-5000", bench_complete_rebuild, paths);
+    
+    // Matches come from the index while it is fresh
+    set_variable("PATH", dir, 1);
+    refresh_completion_index();
+    run_benchmark("complete/prefix-1-match", bench_complete, "cmd01234");
+    run_benchmark("complete/prefix-100-matches", bench_complete, "cmd012");
+    run_benchmark("complete/prefix-no-match", bench_complete, "zzz");
+    
+    free(paths[0]);
+    free(paths[1]);
+    remove_bench_dir(dir, BENCH_DIR_ENTRIES);
+    set_variable("PATH", original, 1);
+    refresh_completion_index();
+    free(original);
+}
+
+// Function to benchmark starting commands with each spawn backend
+void run_exec_benchmarks(void) {
+    SpawnBackend saved = spawn_backend;
+    
+    run_benchmark("execute_command/builtin", bench_run_line, "echo hi > /dev/null");
+    
+    spawn_backend = SPAWN_BACKEND_POSIX;
+    run_benchmark("execute_command/posix_spawn", bench_run_line, "true");
+    run_benchmark("execute_pipeline/posix_spawn-4", bench_run_line, "true | true | true | true");
+    
+    spawn_backend = SPAWN_BACKEND_FORK;
+    run_benchmark("execute_command/fork", bench_run_line, "true");
+    run_benchmark("execute_pipeline/fork-4", bench_run_line, "true | true | true | true");
+    
+    spawn_backend = saved;
+}
+
+// Function to push PIPE_BENCH_BYTES through pipelines of 1 to 8 cat stages,
+// with the default pipe capacity and with 1 MiB pipes. Context switches come
+// from the children's rusage, which the shell collects with wait4.
+void run_pipe_benchmarks(void) {
+    long saved = pipe_size;
+    const char *sizes[] = {"default", "1M"};
+    
+    for (int s = 0; s < 2; s++) {
+        for (int stages = 1; stages <= 8; stages *= 2) {
+            char name[64];
+            snprintf(name, sizeof(name), "pipe/%d-stage/pipesize=%s", stages, sizes[s]);
+            if (!bench_selected(name)) continue;
+            if (set_pipe_size(sizes[s]) != 0) continue;
+            
+            char head[64];
+            snprintf(head, sizeof(head), "head -c %ld /dev/zero", PIPE_BENCH_BYTES);
+            char *line = repeat_words(head, "| cat", stages);
+            char *redirected = NULL;
+            if (asprintf(&redirected, "%s > /dev/null", line) == -1) {
+                perror("asprintf failed");
+                exit(1);
+            }
+            
+            struct rusage before, after;
+            getrusage(RUSAGE_CHILDREN, &before);
+            long long start = monotonic_ns();
+            bench_run_line(redirected);
+            long long elapsed = monotonic_ns() - start;
+            getrusage(RUSAGE_CHILDREN, &after);
+            
+            long switches = (after.ru_nvcsw - before.ru_nvcsw) + (after.ru_nivcsw - before.ru_nivcsw);
+            printf("%-36s %10.1f MB/s %14.1f ctx switches/stage\n", name,
+                   PIPE_BENCH_BYTES / 1e6 / (elapsed / 1e9), (double)switches / (stages + 1));
+            fflush(stdout);
+            free(redirected);
+            free(line);
+        }
+    }
+    
+    pipe_size = saved;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        bench_filter = argv[1];
+    }
+    
+    import_environment();
+    init_jobs();
+    
+    run_parse_benchmarks();
+    run_lookup_benchmarks();
+    run_completion_benchmarks();
+    run_exec_benchmarks();
+    run_pipe_benchmarks();
+    return 0;
+}
@@ -0,0 +1,5326 @@
+#define _GNU_SOURCE  // For pipe2
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>  // For mkdir
+#include <sys/mman.h>
+#include <sys/file.h>  // For flock
+#include <sys/time.h>
+#include <sys/resource.h>  // For wait4 and getrusage
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>  // For PIPE_BUF
+#include <readline/readline.h>
+#include <readline/history.h>
+#include <dirent.h>
+#include <time.h>
+#include <spawn.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // For SSE2/AVX2 scanning in the lexer
+#endif
+#include "shell.h"
+
+extern char **environ;
+
+// List of builtin commands
+const char *builtins[] = {"echo", "exit", "type", "pwd", "cd", "hash", "set", "batch",
+                          "jobs", "wait", "fg", "bg", "export", "unset", "local", "history"};
+const int num_builtins = 16;
+
+const char *redir_op_text[] = {">", ">>", "<", "<>", ">&", "<&", "&>", "&>>", "<<", "<<-", "<<<"};
+
+// Characters that end a run of ordinary characters in an unquoted word
+const char word_special_chars[] = " \t\n|<>&;'\"\\$`";
+
+// Characters with a meaning inside double quotes
+const char dquote_special_chars[] = "\"\\$`";
+
+// The two sets above, with the lexer's scan tables
+ScanSet word_scan_set = {word_special_chars, sizeof(word_special_chars) - 1};
+ScanSet dquote_scan_set = {dquote_special_chars, sizeof(dquote_special_chars) - 1};
+
+// Quote characters, which stop a here-document delimiter from expanding its body
+ScanSet quote_scan_set = {"'\"\\", 3};
+
+// Characters with a meaning in an expanded here-document body
+ScanSet heredoc_scan_set = {"$`\\", 3};
+
+// Function that reads the next line of input for a here-document body, or
+// returns NULL at the end of input. Set by whatever is feeding the shell lines.
+char* (*read_input_line)(const char *prompt) = NULL;
+
+// Command hash table and the PATH value it was filled under
+HashEntry *command_hash[HASH_BUCKETS];
+char *command_hash_path = NULL;
+
+// Shell variables, imported from the environment at startup
+Variable *variables[VAR_BUCKETS];
+
+// Environment for new commands, rebuilt from the exported variables only
+// after one of them changes
+char **exported_env = NULL;
+int exported_env_count = 0;
+int exported_env_dirty = 1;
+
+const char *trace_event_names[] = {"read", "parse", "lookup", "pipe", "spawn", "fork", "exec", "wait", "reap"};
+
+// Trace ring, allocated only when SHELL_TRACE is set. When events come
+// faster than flushes, the oldest are overwritten and counted as dropped.
+TraceEvent *trace_ring = NULL;
+unsigned long trace_head = 0;      // Events recorded so far
+unsigned long trace_flushed = 0;   // Events written (or dropped) so far
+int trace_fd = -1;
+pid_t trace_pid = 0;               // Process that owns the unflushed events
+
+// Events seen at each traced call site, counted while trace_counting is set
+// (for the --replay report) whether or not a trace file is open
+unsigned long trace_counts[TRACE_EVENT_TYPES];
+int trace_counting = 0;
+
+// File every line read is logged to (see --record), and when logging began
+int record_fd = -1;
+long long record_start_ns = 0;
+
+// Latencies of the lines run so far by --replay, by command name, and the
+// reader the recorded lines come from
+ReplayGroup *replay_groups = NULL;
+int num_replay_groups = 0;
+LineReader *replay_reader = NULL;
+long long replay_started_ns = 0;
+pid_t replay_pid = 0;
+
+// Persistent history, opened by interactive shells
+History history = {.fd = -1};
+
+// Directories redirections have been seen to need and find, relative to the
+// current directory (flushed by cd)
+DirCacheEntry *dir_cache[DIR_CACHE_BUCKETS];
+
+// Tab completion index, built on first use
+CompletionIndex completion_index;
+
+// Arena for everything parsed from the current input line
+Arena line_arena;
+
+SpawnBackend spawn_backend = SPAWN_BACKEND_POSIX;
+
+// Capacity for the pipes the shell creates, or 0 for the kernel default
+// (see 'set -o pipesize=...')
+long pipe_size = 0;
+
+// Background and stopped jobs, oldest first
+Job **job_table = NULL;
+int num_jobs = 0;
+int job_capacity = 0;
+
+// Whether the shell reads commands from a terminal, and whether it also
+// manages process groups and the terminal's foreground group
+int interactive = 0;
+int job_control = 0;
+pid_t shell_pgid = 0;
+
+// Self-pipe written by the SIGCHLD handler, so reaping happens outside it
+int sigchld_pipe[2] = {-1, -1};
+
+// Exit status of the last pipeline
+int last_status = 0;
+
+// Process of the last background job ($!), or 0 before there is one
+pid_t last_background_pid = 0;
+
+// Name of the shell, or of the script it is running ($0)
+const char *shell_name = "shell";
+
+// Function to allocate memory from an arena. Never returns NULL.
+void* arena_alloc(Arena *arena, size_t size) {
+    // Keep every allocation suitably aligned
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    
+    // Use the current block, or any later block kept from a previous line
+    ArenaBlock *last = arena->current;
+    while (arena->current && arena->current->used + size > arena->current->size) {
+        last = arena->current;
+        arena->current = arena->current->next;
+        if (arena->current) arena->current->used = 0;
+    }
+    
+    if (!arena->current) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *block = malloc(sizeof(ArenaBlock) + block_size);
+        if (!block) {
+            perror("malloc failed");
+            exit(1);
+        }
+        block->size = block_size;
+        block->used = 0;
+        block->next = NULL;
+        
+        // Append to the chain, after the block the search ran off the end of
+        if (!arena->head) {
+            arena->head = block;
+        } else {
+            last->next = block;
+        }
+        arena->current = block;
+    }
+    
+    void *ptr = (char *)arena->current->data + arena->current->used;
+    arena->current->used += size;
+    return ptr;
+}
+
+// Function to copy at most len bytes of a string into an arena
+char* arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Function to copy a string into an arena
+char* arena_strdup(Arena *arena, const char *str) {
+    return arena_strndup(arena, str, strlen(str));
+}
+
+// Function to resize an arena allocation. The last allocation made from a
+// block is extended in place when there is room; otherwise it is copied.
+void* arena_realloc(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    size_t align = sizeof(max_align_t);
+    size_t old_rounded = (old_size + align - 1) & ~(align - 1);
+    size_t new_rounded = (new_size + align - 1) & ~(align - 1);
+    ArenaBlock *block = arena->current;
+    
+    if (ptr && block && (char *)ptr + old_rounded == (char *)block->data + block->used &&
+        block->used - old_rounded + new_rounded <= block->size) {
+        block->used = block->used - old_rounded + new_rounded;
+        return ptr;
+    }
+    
+    void *new_ptr = arena_alloc(arena, new_size);
+    if (ptr && old_size > 0) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return new_ptr;
+}
+
+// Function to release everything allocated from an arena. Up to
+// ARENA_KEEP_BLOCKS blocks of the standard size are kept for reuse; the rest
+// go back to malloc, so one huge line doesn't slow every later reset.
+void arena_reset(Arena *arena) {
+    ArenaBlock **link = &arena->head;
+    int kept = 0;
+    while (*link) {
+        ArenaBlock *block = *link;
+        if (block->size > ARENA_BLOCK_SIZE || kept == ARENA_KEEP_BLOCKS) {
+            *link = block->next;
+            free(block);
+        } else {
+            block->used = 0;
+            link = &block->next;
+            kept++;
+        }
+    }
+    arena->current = arena->head;
+}
+
+// Function to make room for len more bytes in an output buffer
+void outbuf_reserve(OutBuf *out, size_t len) {
+    if (out->len + len <= out->capacity) {
+        return;
+    }
+    size_t new_capacity = out->capacity ? out->capacity : 256;
+    while (new_capacity < out->len + len) {
+        new_capacity *= 2;
+    }
+    char *data = realloc(out->data, new_capacity);
+    if (!data) {
+        perror("realloc failed");
+        exit(1);
+    }
+    out->data = data;
+    out->capacity = new_capacity;
+}
+
+// Function to add bytes to an output buffer
+void outbuf_append(OutBuf *out, const char *str, size_t len) {
+    outbuf_reserve(out, len);
+    memcpy(out->data + out->len, str, len);
+    out->len += len;
+}
+
+// Function to add a string to an output buffer
+void outbuf_puts(OutBuf *out, const char *str) {
+    outbuf_append(out, str, strlen(str));
+}
+
+// Function to add formatted text to an output buffer
+__attribute__((format(printf, 2, 3)))
+void outbuf_printf(OutBuf *out, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(out->data ? out->data + out->len : NULL,
+                        out->capacity - out->len, format, ap);
+    va_end(ap);
+    if (len < 0) {
+        return;
+    }
+    
+    // Format again if it didn't fit
+    if (out->len + len + 1 > out->capacity) {
+        outbuf_reserve(out, len + 1);
+        va_start(ap, format);
+        vsnprintf(out->data + out->len, len + 1, format, ap);
+        va_end(ap);
+    }
+    out->len += len;
+}
+
+// Function to write out and empty an output buffer. Returns -1 on a write error.
+int outbuf_flush(OutBuf *out, int fd) {
+    size_t written = 0;
+    int result = 0;
+    while (written < out->len) {
+        ssize_t n = write(fd, out->data + written, out->len - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+        written += n;
+    }
+    out->len = 0;
+    return result;
+}
+
+// Function to release an output buffer
+void outbuf_free(OutBuf *out) {
+    free(out->data);
+    out->data = NULL;
+    out->len = out->capacity = 0;
+}
+
+// Hash a string for the command hash table (FNV-1a)
+unsigned int hash_string(const char *str) {
+    unsigned int hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Function to read CLOCK_MONOTONIC in nanoseconds
+long long monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Function to get the start time of a traced phase; 0 when tracing is off, so
+// an untraced shell doesn't read the clock
+long long trace_clock(void) {
+    return trace_ring ? monotonic_ns() : 0;
+}
+
+// Function to record a trace event for a phase that started at start_ns
+// (0 for an instant). Only fills in a slot of the ring; nothing is
+// formatted or written until trace_flush.
+void trace_event(TraceEventType type, long long start_ns, pid_t pid, int status,
+                 const char *name, size_t name_len) {
+    if (trace_counting) {
+        trace_counts[type]++;
+    }
+    if (!trace_ring) {
+        return;
+    }
+    
+    long long now = monotonic_ns();
+    TraceEvent *event = &trace_ring[trace_head++ % TRACE_RING_EVENTS];
+    event->type = type;
+    event->ts_ns = start_ns ? start_ns : now;
+    event->dur_ns = start_ns ? now - start_ns : 0;
+    event->pid = pid;
+    event->status = status;
+    if (!name) name_len = 0;
+    if (name_len >= TRACE_NAME_LENGTH) name_len = TRACE_NAME_LENGTH - 1;
+    memcpy(event->name, name, name_len);
+    event->name[name_len] = '\0';
+}
+
+// Function to add one trace event to out as a line of JSON
+void format_trace_event(OutBuf *out, TraceEventType type, long long ts_ns, long long dur_ns,
+                        pid_t pid, int status, const char *name) {
+    outbuf_printf(out, "{\"ts\":%lld,\"dur\":%lld,\"ev\":\"%s\",\"shell\":%d,\"pid\":%d,\"status\":%d,\"name\":\"",
+                  ts_ns, dur_ns, trace_event_names[type], (int)trace_pid, (int)pid, status);
+    for (const char *c = name; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            outbuf_append(out, "\\", 1);
+            outbuf_append(out, c, 1);
+        } else if ((unsigned char)*c < 0x20) {
+            outbuf_printf(out, "\\u%04x", (unsigned char)*c);
+        } else {
+            outbuf_append(out, c, 1);
+        }
+    }
+    outbuf_puts(out, "\"}\n");
+}
+
+// Function to write the events recorded since the last flush to the trace
+// file with one write. Called between command lines and at exit, so the
+// formatting and the syscall stay off the path of a running command.
+void trace_flush(void) {
+    if (!trace_ring || trace_head == trace_flushed || getpid() != trace_pid) {
+        return;
+    }
+    
+    OutBuf out = {0};
+    if (trace_head - trace_flushed > TRACE_RING_EVENTS) {
+        unsigned long dropped = trace_head - trace_flushed - TRACE_RING_EVENTS;
+        outbuf_printf(&out, "{\"ts\":%lld,\"ev\":\"dropped\",\"shell\":%d,\"count\":%lu}\n",
+                      monotonic_ns(), (int)trace_pid, dropped);
+        trace_flushed = trace_head - TRACE_RING_EVENTS;
+    }
+    for (; trace_flushed < trace_head; trace_flushed++) {
+        TraceEvent *event = &trace_ring[trace_flushed % TRACE_RING_EVENTS];
+        format_trace_event(&out, event->type, event->ts_ns, event->dur_ns,
+                           event->pid, event->status, event->name);
+    }
+    outbuf_flush(&out, trace_fd);
+    outbuf_free(&out);
+}
+
+// Function to check that a name can be used for a variable
+int is_valid_name(const char *name, size_t len) {
+    if (len == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!(isalnum((unsigned char)name[i]) || name[i] == '_')) return 0;
+    }
+    return 1;
+}
+
+// Function to find a variable by name
+Variable* find_variable(const char *name) {
+    Variable *var = variables[hash_string(name) % VAR_BUCKETS];
+    while (var && strcmp(var->name, name) != 0) {
+        var = var->next;
+    }
+    return var;
+}
+
+// Function to get a variable's value, or NULL if it is not set
+const char* get_variable(const char *name) {
+    Variable *var = find_variable(name);
+    return var ? var->value : NULL;
+}
+
+// Function to set a variable. A NULL value leaves the value as it is, and
+// exported is 1 to export it, 0 to stop exporting it or -1 to keep its state.
+void set_variable(const char *name, const char *value, int exported) {
+    Variable *var = find_variable(name);
+    if (!var) {
+        unsigned int bucket = hash_string(name) % VAR_BUCKETS;
+        var = calloc(1, sizeof(Variable));
+        if (!var || !(var->name = strdup(name))) {
+            perror("malloc failed");
+            exit(1);
+        }
+        var->next = variables[bucket];
+        variables[bucket] = var;
+    }
+    
+    int was_exported = var->exported;
+    if (exported >= 0) var->exported = exported;
+    if (value) {
+        char *copy = strdup(value);
+        if (!copy) {
+            perror("malloc failed");
+            exit(1);
+        }
+        free(var->value);
+        var->value = copy;
+    }
+    if (was_exported || var->exported) exported_env_dirty = 1;
+}
+
+// Function to remove a variable. Returns 0 whether or not it was set.
+int unset_variable(const char *name) {
+    Variable **link = &variables[hash_string(name) % VAR_BUCKETS];
+    while (*link && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    Variable *var = *link;
+    if (!var) {
+        return 0;
+    }
+    
+    *link = var->next;
+    if (var->exported) exported_env_dirty = 1;
+    free(var->name);
+    free(var->value);
+    free(var);
+    return 0;
+}
+
+// Function to load the shell's variables from the environment it started with
+void import_environment(void) {
+    for (char **env = environ; *env != NULL; env++) {
+        char *equals = strchr(*env, '=');
+        if (!equals || !is_valid_name(*env, equals - *env)) continue;
+        
+        char name[MAX_PATH_LENGTH];
+        if ((size_t)(equals - *env) >= sizeof(name)) continue;
+        memcpy(name, *env, equals - *env);
+        name[equals - *env] = '\0';
+        set_variable(name, equals + 1, 1);
+    }
+}
+
+// Function to start tracing to the file named by SHELL_TRACE, if it is set.
+// Events are appended as JSON lines.
+void init_trace(void) {
+    const char *path = get_variable("SHELL_TRACE");
+    if (!path || !*path) {
+        return;
+    }
+    
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "SHELL_TRACE: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    
+    // Keep it out of the range redirections usually name
+    trace_fd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    close(fd);
+    trace_ring = calloc(TRACE_RING_EVENTS, sizeof(TraceEvent));
+    if (trace_fd == -1 || !trace_ring) {
+        perror("SHELL_TRACE");
+        free(trace_ring);
+        trace_ring = NULL;
+        return;
+    }
+    trace_pid = getpid();
+    atexit(trace_flush);
+}
+
+// Function to get the environment for new commands, rebuilding it first if
+// an exported variable changed since it was last built
+char** shell_environment(void) {
+    if (!exported_env_dirty) {
+        return exported_env;
+    }
+    
+    for (int i = 0; i < exported_env_count; i++) {
+        free(exported_env[i]);
+    }
+    exported_env_count = 0;
+    
+    int count = 0;
+    for (int i = 0; i < VAR_BUCKETS; i++) {
+        for (Variable *var = variables[i]; var; var = var->next) {
+            if (var->exported && var->value) count++;
+        }
+    }
+    
+    char **env = realloc(exported_env, (count + 1) * sizeof(char*));
+    if (!env) {
+        perror("malloc failed");
+        exit(1);
+    }
+    exported_env = env;
+    for (int i = 0; i < VAR_BUCKETS; i++) {
+        for (Variable *var = variables[i]; var; var = var->next) {
+            if (!var->exported || !var->value) continue;
+            size_t len = strlen(var->name) + strlen(var->value) + 2;
+            char *entry = malloc(len);
+            if (!entry) {
+                perror("malloc failed");
+                exit(1);
+            }
+            snprintf(entry, len, "%s=%s", var->name, var->value);
+            exported_env[exported_env_count++] = entry;
+        }
+    }
+    exported_env[exported_env_count] = NULL;
+    exported_env_dirty = 0;
+    return exported_env;
+}
+
+// Function to check whether two NAME=value strings set the same name
+int same_variable_name(const char *a, const char *b) {
+    size_t len = strcspn(a, "=");
+    return strncmp(a, b, len) == 0 && b[len] == '=';
+}
+
+// Function to get the environment for an external command: the exported
+// variables, with the command's own NAME=value prefixes added over them
+char** command_environment(SimpleCommand *cmd) {
+    char **env = shell_environment();
+    if (cmd->num_assigns == 0) {
+        return env;
+    }
+    
+    char **result = arena_alloc(&line_arena, (exported_env_count + cmd->num_assigns + 1) * sizeof(char*));
+    int count = 0;
+    for (char **entry = env; *entry != NULL; entry++) {
+        int overridden = 0;
+        for (int i = 0; i < cmd->num_assigns && !overridden; i++) {
+            overridden = same_variable_name(cmd->assigns[i], *entry);
+        }
+        if (!overridden) result[count++] = *entry;
+    }
+    for (int i = 0; i < cmd->num_assigns; i++) {
+        // The last of several assignments to one name wins
+        int later = 0;
+        for (int j = i + 1; j < cmd->num_assigns && !later; j++) {
+            later = same_variable_name(cmd->assigns[i], cmd->assigns[j]);
+        }
+        if (!later) result[count++] = cmd->assigns[i];
+    }
+    result[count] = NULL;
+    return result;
+}
+
+// Function to set a command's NAME=value assignments as shell variables.
+// With saved, the variables' previous states are kept there so that
+// restore_assignments can put them back.
+void apply_assignments(SimpleCommand *cmd, SavedVariable *saved, int exported) {
+    for (int i = 0; i < cmd->num_assigns; i++) {
+        char *equals = strchr(cmd->assigns[i], '=');
+        char *name = arena_strndup(&line_arena, cmd->assigns[i], equals - cmd->assigns[i]);
+        if (saved) {
+            Variable *var = find_variable(name);
+            saved[i].name = name;
+            saved[i].existed = var != NULL;
+            saved[i].value = var && var->value ? arena_strdup(&line_arena, var->value) : NULL;
+            saved[i].exported = var ? var->exported : 0;
+        }
+        set_variable(name, equals + 1, exported);
+    }
+}
+
+// Function to undo apply_assignments, most recent first
+void restore_assignments(SimpleCommand *cmd, SavedVariable *saved) {
+    for (int i = cmd->num_assigns - 1; i >= 0; i--) {
+        unset_variable(saved[i].name);
+        if (saved[i].existed) {
+            set_variable(saved[i].name, saved[i].value, saved[i].exported);
+        }
+    }
+}
+
+// Function to read the executables of one PATH directory into the index
+void index_directory(IndexedDir *entry) {
+    for (int i = 0; i < entry->count; i++) {
+        free(entry->names[i]);
+    }
+    entry->count = 0;
+    
+    DIR *d = opendir(entry->dir);
+    if (!d) return;
+    
+    struct dirent *dirent;
+    while ((dirent = readdir(d)) != NULL) {
+        // Skip . and .. entries
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        
+        // Check if it's executable
+        char full_path[MAX_PATH_LENGTH];
+        snprintf(full_path, MAX_PATH_LENGTH, "%s/%s", entry->dir, dirent->d_name);
+        if (access(full_path, X_OK) != 0) {
+            continue;
+        }
+        
+        // Grow the names array if needed
+        if (entry->count >= entry->capacity) {
+            int new_capacity = entry->capacity == 0 ? 64 : entry->capacity * 2;
+            char **new_names = realloc(entry->names, new_capacity * sizeof(char*));
+            if (!new_names) break;
+            entry->names = new_names;
+            entry->capacity = new_capacity;
+        }
+        
+        entry->names[entry->count] = strdup(dirent->d_name);
+        if (!entry->names[entry->count]) break;
+        entry->count++;
+    }
+    closedir(d);
+}
+
+// Compare two names for qsort
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Function to merge every indexed directory and the builtins into one sorted table
+void merge_completion_index(void) {
+    int total = num_builtins;
+    for (int i = 0; i < completion_index.num_dirs; i++) {
+        total += completion_index.dirs[i].count;
+    }
+    
+    const char **names = realloc(completion_index.names, (total > 0 ? total : 1) * sizeof(char*));
+    if (!names) {
+        perror("realloc failed");
+        return;
+    }
+    completion_index.names = names;
+    
+    int count = 0;
+    for (int i = 0; i < num_builtins; i++) {
+        names[count++] = builtins[i];
+    }
+    for (int i = 0; i < completion_index.num_dirs; i++) {
+        for (int j = 0; j < completion_index.dirs[i].count; j++) {
+            names[count++] = completion_index.dirs[i].names[j];
+        }
+    }
+    
+    // Sort and drop duplicates (the same name in several directories)
+    qsort(names, count, sizeof(char*), compare_names);
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique == 0 || strcmp(names[unique - 1], names[i]) != 0) {
+            names[unique++] = names[i];
+        }
+    }
+    completion_index.count = unique;
+}
+
+// Function to free the per-directory part of the index
+void free_indexed_dirs(void) {
+    for (int i = 0; i < completion_index.num_dirs; i++) {
+        IndexedDir *entry = &completion_index.dirs[i];
+        for (int j = 0; j < entry->count; j++) {
+            free(entry->names[j]);
+        }
+        free(entry->names);
+        free(entry->dir);
+    }
+    free(completion_index.dirs);
+    completion_index.dirs = NULL;
+    completion_index.num_dirs = 0;
+}
+
+// Function to bring the completion index up to date with PATH.
+// Directories are only re-read when their mtime changes, and mtimes are
+// only checked once per COMPLETION_RECHECK_NS.
+void refresh_completion_index(void) {
+    const char *path = get_variable("PATH");
+    if (!path) path = "";
+    
+    int path_changed = !completion_index.path || strcmp(completion_index.path, path) != 0;
+    
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (!path_changed && completion_index.names &&
+        now_ns - completion_index.checked_ns < COMPLETION_RECHECK_NS) {
+        return;
+    }
+    completion_index.checked_ns = now_ns;
+    
+    if (path_changed) {
+        // Rebuild the directory list from the new PATH
+        free_indexed_dirs();
+        free(completion_index.path);
+        completion_index.path = strdup(path);
+        
+        char path_copy[MAX_PATH_LENGTH];
+        strncpy(path_copy, path, MAX_PATH_LENGTH - 1);
+        path_copy[MAX_PATH_LENGTH - 1] = '\0';
+        
+        for (char *dir = strtok(path_copy, ":"); dir != NULL; dir = strtok(NULL, ":")) {
+            IndexedDir *dirs = realloc(completion_index.dirs, (completion_index.num_dirs + 1) * sizeof(IndexedDir));
+            if (!dirs) break;
+            completion_index.dirs = dirs;
+            
+            IndexedDir *entry = &dirs[completion_index.num_dirs];
+            memset(entry, 0, sizeof(IndexedDir));
+            entry->dir = strdup(dir);
+            if (!entry->dir) break;
+            entry->scanned = 0;
+            completion_index.num_dirs++;
+        }
+    }
+    
+    // Re-read any directory whose mtime moved
+    int changed = path_changed || !completion_index.names;
+    for (int i = 0; i < completion_index.num_dirs; i++) {
+        IndexedDir *entry = &completion_index.dirs[i];
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if (stat(entry->dir, &st) == 0) {
+            mtime = st.st_mtim;
+        }
+        
+        if (!entry->scanned || mtime.tv_sec != entry->mtime.tv_sec || mtime.tv_nsec != entry->mtime.tv_nsec) {
+            index_directory(entry);
+            entry->mtime = mtime;
+            entry->scanned = 1;
+            changed = 1;
+        }
+    }
+    
+    if (changed) {
+        merge_completion_index();
+    }
+}
+
+// Function to find the first index entry not sorting before prefix
+int completion_index_lower_bound(const char *prefix) {
+    int lo = 0;
+    int hi = completion_index.count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(completion_index.names[mid], prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Function to generate completions for commands
+char* command_generator(const char* text, int state) {
+    static int list_index, len;
+    
+    // If this is a new word to complete, initialize now
+    if (!state) {
+        refresh_completion_index();
+        list_index = completion_index_lower_bound(text);
+        len = strlen(text);
+    }
+    
+    // Matches are contiguous in the sorted index
+    if (list_index < completion_index.count) {
+        const char *name = completion_index.names[list_index];
+        if (strncmp(name, text, len) == 0) {
+            list_index++;
+            return strdup(name);
+        }
+    }
+    
+    return NULL;  // No more matches
+}
+
+// Function to attempt completion
+char** command_completion(const char* text, int start, int end) {
+    char **matches = NULL;
+    
+    // Only complete at the start of the line
+    if (start == 0) {
+        // Get all matches
+        matches = rl_completion_matches(text, command_generator);
+    }
+    
+    return matches;
+}
+
+// Initialize readline
+void init_readline(void) {
+    // Tell readline to use our completion function
+    rl_attempted_completion_function = command_completion;
+    
+    // Disable filename completion
+    rl_completer_quote_characters = "";
+    rl_completer_word_break_characters = " \t\n\"\\'`@$><=;|&{(";
+}
+
+int is_builtin(const char *cmd) {
+    for (int i = 0; i < num_builtins; i++) {
+        if (strcmp(cmd, builtins[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to search every PATH directory for an executable. A name with a
+// slash is the path of the file itself, so PATH isn't searched; it has to
+// be a regular file (a directory passes the access check).
+char* search_path(const char *cmd) {
+    if (strchr(cmd, '/')) {
+        struct stat st;
+        if (stat(cmd, &st) == -1 || !S_ISREG(st.st_mode) || access(cmd, X_OK) != 0) {
+            return NULL;
+        }
+        return strdup(cmd);
+    }
+    
+    const char *path = get_variable("PATH");
+    if (!path) return NULL;
+    
+    // Make a copy of PATH since strtok modifies its argument
+    char path_copy[MAX_PATH_LENGTH];
+    strncpy(path_copy, path, MAX_PATH_LENGTH - 1);
+    path_copy[MAX_PATH_LENGTH - 1] = '\0';
+    
+    // Split PATH into directories
+    char *dir = strtok(path_copy, ":");
+    while (dir != NULL) {
+        char full_path[MAX_PATH_LENGTH];
+        snprintf(full_path, MAX_PATH_LENGTH, "%s/%s", dir, cmd);
+        
+        // Check if file exists and is executable
+        if (access(full_path, X_OK) == 0) {
+            return strdup(full_path);
+        }
+        
+        dir = strtok(NULL, ":");
+    }
+    
+    return NULL;
+}
+
+// Drop every remembered command location
+void hash_flush(void) {
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        HashEntry *entry = command_hash[i];
+        while (entry) {
+            HashEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        command_hash[i] = NULL;
+    }
+}
+
+// Flush the table if PATH changed since it was filled
+void hash_check_path(void) {
+    const char *path = get_variable("PATH");
+    if (!path) path = "";
+    
+    if (command_hash_path && strcmp(command_hash_path, path) == 0) {
+        return;
+    }
+    
+    hash_flush();
+    free(command_hash_path);
+    command_hash_path = strdup(path);
+}
+
+// Function to look up a remembered command location
+HashEntry* hash_lookup(const char *name) {
+    hash_check_path();
+    
+    HashEntry *entry = command_hash[hash_string(name) % HASH_BUCKETS];
+    while (entry) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+// Function to remember (or update) a command location
+HashEntry* hash_insert(const char *name, const char *path) {
+    HashEntry *entry = hash_lookup(name);
+    if (entry) {
+        char *new_path = strdup(path);
+        if (!new_path) return NULL;
+        free(entry->path);
+        entry->path = new_path;
+        return entry;
+    }
+    
+    entry = malloc(sizeof(HashEntry));
+    if (!entry) return NULL;
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    if (!entry->name || !entry->path) {
+        free(entry->name);
+        free(entry->path);
+        free(entry);
+        return NULL;
+    }
+    entry->hits = 0;
+    
+    unsigned int bucket = hash_string(name) % HASH_BUCKETS;
+    entry->next = command_hash[bucket];
+    command_hash[bucket] = entry;
+    return entry;
+}
+
+// Function to forget a remembered command location
+int hash_delete(const char *name) {
+    hash_check_path();
+    
+    HashEntry **link = &command_hash[hash_string(name) % HASH_BUCKETS];
+    while (*link) {
+        HashEntry *entry = *link;
+        if (strcmp(entry->name, name) == 0) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return 1;
+        }
+        link = &entry->next;
+    }
+    return 0;
+}
+
+// Resolve a command to a path, using the hash table before scanning PATH
+char* find_executable(const char *cmd) {
+    // Names with a slash are never hashed
+    if (strchr(cmd, '/')) {
+        return search_path(cmd);
+    }
+    
+    HashEntry *entry = hash_lookup(cmd);
+    if (!entry) {
+        char *path = search_path(cmd);
+        if (!path) return NULL;
+        
+        entry = hash_insert(cmd, path);
+        if (!entry) return path;
+        free(path);
+    }
+    
+    entry->hits++;
+    return strdup(entry->path);
+}
+
+// Print the result of 'type' for a single name
+void print_type(const char *name, OutBuf *out) {
+    // Check if it's a builtin
+    if (is_builtin(name)) {
+        outbuf_printf(out, "%s is a shell builtin\n", name);
+        return;
+    }
+    
+    // Check if it's already in the hash table
+    HashEntry *entry = strchr(name, '/') ? NULL : hash_lookup(name);
+    if (entry) {
+        outbuf_printf(out, "%s is hashed (%s)\n", name, entry->path);
+        return;
+    }
+    
+    // Check if it's an executable in PATH
+    char *exec_path = search_path(name);
+    if (exec_path) {
+        outbuf_printf(out, "%s is %s\n", name, exec_path);
+        free(exec_path);
+    } else {
+        outbuf_printf(out, "%s: not found\n", name);
+    }
+}
+
+// Handle the 'hash' builtin: hash [-lr] [-d name] [name ...]
+int handle_hash(char **args, OutBuf *out) {
+    int list_reusable = 0;
+    int status = 0;
+    int i = 1;
+    
+    // Parse options
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(args[i], "-r") == 0) {
+            hash_flush();
+        } else if (strcmp(args[i], "-l") == 0) {
+            list_reusable = 1;
+        } else if (strcmp(args[i], "-d") == 0) {
+            // Remaining names are deleted instead of added
+            if (args[i + 1] == NULL) {
+                fprintf(stderr, "hash: -d: option requires an argument\n");
+                return 1;
+            }
+            for (i++; args[i] != NULL; i++) {
+                if (!hash_delete(args[i])) {
+                    fprintf(stderr, "hash: %s: not found\n", args[i]);
+                    status = 1;
+                }
+            }
+            return status;
+        } else {
+            fprintf(stderr, "hash: %s: invalid option\n", args[i]);
+            fprintf(stderr, "hash: usage: hash [-lr] [-d name] [name ...]\n");
+            return 1;
+        }
+    }
+    
+    // Names given: look them up and remember them
+    if (args[i] != NULL) {
+        for (; args[i] != NULL; i++) {
+            if (is_builtin(args[i]) || strchr(args[i], '/')) continue;  // Never hashed
+            
+            char *path = search_path(args[i]);
+            if (!path) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+                status = 1;
+                continue;
+            }
+            HashEntry *entry = hash_insert(args[i], path);
+            if (entry) entry->hits = 0;
+            free(path);
+        }
+        return status;
+    }
+    
+    // No names: list the table (unless it was just cleared)
+    if (args[1] != NULL && !list_reusable) {
+        return 0;
+    }
+    
+    hash_check_path();
+    int printed = 0;
+    for (int b = 0; b < HASH_BUCKETS; b++) {
+        for (HashEntry *entry = command_hash[b]; entry; entry = entry->next) {
+            if (list_reusable) {
+                outbuf_printf(out, "builtin hash -p %s %s\n", entry->path, entry->name);
+            } else {
+                if (!printed) outbuf_puts(out, "hits\tcommand\n");
+                outbuf_printf(out, "%4d\t%s\n", entry->hits, entry->path);
+            }
+            printed = 1;
+        }
+    }
+    if (!printed) {
+        outbuf_puts(out, "hash: hash table empty\n");
+    }
+    return 0;
+}
+
+// Function to check whether a directory is known to exist
+int dir_cache_contains(const char *path) {
+    for (DirCacheEntry *entry = dir_cache[hash_string(path) % DIR_CACHE_BUCKETS]; entry; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) return 1;
+    }
+    return 0;
+}
+
+// Function to remember that a directory exists
+void dir_cache_add(const char *path) {
+    DirCacheEntry *entry = malloc(sizeof(DirCacheEntry));
+    if (!entry) return;  // Just means no caching
+    entry->path = strdup(path);
+    if (!entry->path) {
+        free(entry);
+        return;
+    }
+    unsigned int bucket = hash_string(path) % DIR_CACHE_BUCKETS;
+    entry->next = dir_cache[bucket];
+    dir_cache[bucket] = entry;
+}
+
+// Function to forget every cached directory
+void dir_cache_flush(void) {
+    for (int b = 0; b < DIR_CACHE_BUCKETS; b++) {
+        DirCacheEntry *entry = dir_cache[b];
+        while (entry) {
+            DirCacheEntry *next = entry->next;
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        dir_cache[b] = NULL;
+    }
+}
+
+// Function to make sure a directory exists, creating only the components
+// that are missing. A directory that already exists costs one mkdirat the
+// first time and nothing after that. path is modified temporarily.
+// Returns -1 if the directory can't be created.
+int ensure_directory(char *path) {
+    if (dir_cache_contains(path)) {
+        return 0;
+    }
+    if (mkdirat(AT_FDCWD, path, 0777) == 0 || errno == EEXIST) {
+        dir_cache_add(path);
+        return 0;
+    }
+    if (errno != ENOENT) {
+        return -1;
+    }
+    
+    // Something further up is missing: make the parent, then try again
+    char *slash = strrchr(path, '/');
+    while (slash && slash > path && slash[-1] == '/') slash--;
+    if (!slash || slash == path) {
+        return -1;
+    }
+    *slash = '\0';
+    int result = ensure_directory(path);
+    *slash = '/';
+    if (result != 0) {
+        return -1;
+    }
+    
+    if (mkdirat(AT_FDCWD, path, 0777) == 0 || errno == EEXIST) {
+        dir_cache_add(path);
+        return 0;
+    }
+    return -1;
+}
+
+// Function to create the directories leading up to a redirection target
+void create_parent_directories(const char *filename) {
+    const char *last_slash = strrchr(filename, '/');
+    if (last_slash != NULL && last_slash > filename) {
+        char *dir = arena_strndup(&line_arena, filename, last_slash - filename);
+        ensure_directory(dir);
+    }
+}
+
+// Function to check for a character that separates words
+int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+// Function to build a scan set's tables: a bitmap for the scalar scan, and
+// each character repeated across a vector for the SIMD scans
+void scan_set_init(ScanSet *set) {
+    memset(set->bits, 0, sizeof(set->bits));
+    for (size_t i = 0; i < set->len; i++) {
+        unsigned char c = set->chars[i];
+        set->bits[c >> 6] |= 1ULL << (c & 63);
+        memset(set->needles[i], c, sizeof(set->needles[i]));
+    }
+    set->ready = 1;
+}
+
+// Function to find the first byte in [p, end) that is in set, using plain
+// byte comparisons
+const char* scan_special_scalar(const char *p, const char *end, const ScanSet *set) {
+    while (p < end) {
+        unsigned char c = *p;
+        if (set->bits[c >> 6] & (1ULL << (c & 63))) break;
+        p++;
+    }
+    return p;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same as scan_special_scalar, 32 bytes at a time
+__attribute__((target("avx2")))
+const char* scan_special_avx2(const char *p, const char *end, const ScanSet *set) {
+    __m256i needles[SCAN_MAX_SET];
+    for (size_t i = 0; i < set->len; i++) {
+        needles[i] = _mm256_load_si256((const __m256i *)set->needles[i]);
+    }
+    
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hits = _mm256_cmpeq_epi8(chunk, needles[0]);
+        for (size_t i = 1; i < set->len; i++) {
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, needles[i]));
+        }
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return scan_special_scalar(p, end, set);
+}
+
+// Same as scan_special_scalar, 16 bytes at a time
+const char* scan_special_sse2(const char *p, const char *end, const ScanSet *set) {
+    __m128i needles[SCAN_MAX_SET];
+    for (size_t i = 0; i < set->len; i++) {
+        needles[i] = _mm_load_si128((const __m128i *)set->needles[i]);
+    }
+    
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_cmpeq_epi8(chunk, needles[0]);
+        for (size_t i = 1; i < set->len; i++) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, needles[i]));
+        }
+        int mask = _mm_movemask_epi8(hits);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return scan_special_scalar(p, end, set);
+}
+#endif
+
+// Function to find the first byte in [p, end) that is in set. Short input
+// is scanned a byte at a time, as are the first SCAN_SCALAR_PREFIX bytes of
+// longer input, since most words are short; a longer run continues with the
+// widest vector unit the CPU has.
+const char* scan_special(const char *p, const char *end, ScanSet *set) {
+    if (!set->ready) {
+        scan_set_init(set);
+    }
+    if (end - p < SCAN_VECTOR_MIN) {
+        return scan_special_scalar(p, end, set);
+    }
+    
+    const char *prefix_end = p + SCAN_SCALAR_PREFIX;
+    while (p < prefix_end) {
+        unsigned char c = *p;
+        if (set->bits[c >> 6] & (1ULL << (c & 63))) return p;
+        p++;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    static int use_avx2 = -1;
+    if (use_avx2 < 0) {
+        use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    
+    // At least SCAN_VECTOR_MIN - SCAN_SCALAR_PREFIX bytes are left
+    if (use_avx2) {
+        return scan_special_avx2(p, end, set);
+    }
+    return scan_special_sse2(p, end, set);
+#else
+    return scan_special_scalar(p, end, set);
+#endif
+}
+
+// Function to find the end of a run of ordinary unquoted word characters
+const char* scan_word_chars(const char *p, const char *end) {
+    return scan_special(p, end, &word_scan_set);
+}
+
+// Function to find the next character with a meaning inside double quotes
+const char* scan_dquote_chars(const char *p, const char *end) {
+    return scan_special(p, end, &dquote_scan_set);
+}
+
+// Function to add characters to the word being assembled
+void lexer_append(Lexer *lexer, const char *str, size_t len) {
+    // While parsing the buffer is as long as the line, and a word never grows
+    // past its source text; only substituted output can outgrow it
+    if (lexer->word_len + len >= lexer->word_capacity) {
+        size_t capacity = (lexer->word_len + len + 1) * 2;
+        lexer->word = arena_realloc(&line_arena, lexer->word, lexer->word_capacity, capacity);
+        lexer->word_capacity = capacity;
+    }
+    memcpy(lexer->word + lexer->word_len, str, len);
+    lexer->word_len += len;
+}
+
+// Function to find the parenthesis that closes a nested command, skipping
+// over quoted text and escapes. Returns NULL if there is none.
+const char* find_closing_paren(const char *p, const char *end) {
+    int depth = 1;
+    while (p < end) {
+        if (*p == '\\') {
+            p += 2;
+            continue;
+        }
+        if (*p == '\'') {
+            const char *close = memchr(p + 1, '\'', end - p - 1);
+            if (!close) return NULL;
+            p = close + 1;
+            continue;
+        }
+        if (*p == '"') {
+            p++;
+            while (p < end && *p != '"') {
+                p += *p == '\\' ? 2 : 1;
+            }
+            if (p >= end) return NULL;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+// Function to add an argument to a command, growing its argv as needed
+void add_argument(SimpleCommand *cmd, const char *text, size_t len) {
+    // Keep room for the terminating NULL
+    if (cmd->arg_count + 1 >= cmd->arg_capacity) {
+        cmd->args = arena_realloc(&line_arena, cmd->args,
+                                  cmd->arg_capacity * sizeof(char*),
+                                  cmd->arg_capacity * 2 * sizeof(char*));
+        cmd->arg_capacity *= 2;
+    }
+    cmd->args[cmd->arg_count++] = arena_strndup(&line_arena, text, len);
+    cmd->args[cmd->arg_count] = NULL;
+}
+
+// Function to add substituted output to the word. Unless it was quoted, the
+// output is split at blanks into separate words.
+void lexer_append_fields(Lexer *lexer, const char *text, size_t len, int quoted) {
+    if (quoted || !lexer->fields) {
+        lexer_append(lexer, text, len);
+        return;
+    }
+    
+    const char *p = text;
+    const char *end = text + len;
+    while (p < end) {
+        if (is_blank(*p)) {
+            // A blank ends the word so far, if there is one
+            if (lexer->word_len > 0 || lexer->field_started) {
+                add_argument(lexer->fields, lexer->word, lexer->word_len);
+                lexer->word_len = 0;
+                lexer->field_started = 0;
+            }
+            p++;
+            continue;
+        }
+        const char *run = p;
+        while (p < end && !is_blank(*p)) {
+            p++;
+        }
+        lexer_append(lexer, run, p - run);
+    }
+}
+
+// Function to check the [n], [@] or [*] after a variable name in ${NAME[n]}
+int is_valid_subscript(const char *index, size_t len) {
+    if (len == 1 && (*index == '@' || *index == '*')) {
+        return 1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)index[i])) return 0;
+    }
+    return len > 0;
+}
+
+// Function to check for a parameter named by one special character: $?, $!,
+// or a positional parameter $0 to $9
+int is_special_parameter(char c) {
+    return c == '?' || c == '!' || isdigit((unsigned char)c);
+}
+
+// Function to check for a positional parameter's name, such as 1 or 10
+int is_positional_name(const char *name, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)name[i])) return 0;
+    }
+    return len > 0;
+}
+
+// Function to read a $NAME, ${NAME}, $?, $! or $0-$9 reference in a word.
+// The shell takes no arguments, so positional parameters other than $0 are
+// always empty. Lists such as
+// PIPESTATUS are held as space-separated values, and ${NAME[n]} takes the
+// n-th of them (${NAME[@]} all of them). While parsing it only marks the
+// word for expansion; when expanding, it adds the value. Returns -1 on a
+// lexical error.
+int lex_variable(Lexer *lexer, int quoted) {
+    const char *name = lexer->pos + 1;
+    const char *name_end;
+    const char *index = NULL;
+    size_t index_len = 0;
+    if (*name == '{') {
+        name++;
+        const char *close = memchr(name, '}', lexer->end - name);
+        if (!close) {
+            fprintf(stderr, "Error: Unmatched {\n");
+            return -1;
+        }
+        name_end = close;
+        const char *bracket = memchr(name, '[', close - name);
+        if (bracket && close[-1] == ']') {
+            name_end = bracket;
+            index = bracket + 1;
+            index_len = close - 1 - index;
+        }
+        int valid = bracket ? index && is_valid_subscript(index, index_len) : 1;
+        if (!valid || (!(name_end - name == 1 && is_special_parameter(*name)) &&
+                       !is_positional_name(name, name_end - name) && !is_valid_name(name, name_end - name))) {
+            fprintf(stderr, "${%.*s}: bad substitution\n", (int)(close - name), name);
+            return -1;
+        }
+        lexer->pos = close + 1;
+    } else if (is_special_parameter(*name)) {
+        name_end = name + 1;
+        lexer->pos = name_end;
+    } else {
+        name_end = name;
+        while (name_end < lexer->end && (isalnum((unsigned char)*name_end) || *name_end == '_')) {
+            name_end++;
+        }
+        lexer->pos = name_end;
+    }
+    
+    if (!lexer->expand) {
+        lexer->needs_expansion = 1;
+        return 0;
+    }
+    
+    if (isdigit((unsigned char)*name)) {
+        if (name_end - name == 1 && *name == '0') {
+            lexer_append_fields(lexer, shell_name, strlen(shell_name), quoted);
+        }
+        return 0;
+    }
+    if (is_special_parameter(*name)) {
+        char value[16];
+        int len = 0;
+        if (*name == '?') {
+            len = snprintf(value, sizeof(value), "%d", last_status);
+        } else if (last_background_pid > 0) {
+            len = snprintf(value, sizeof(value), "%d", (int)last_background_pid);
+        }
+        lexer_append(lexer, value, len);
+        return 0;
+    }
+    char *key = arena_strndup(&line_arena, name, name_end - name);
+    const char *value = get_variable(key);
+    if (!value) {
+        return 0;
+    }
+    size_t len = strlen(value);
+    if (index && isdigit((unsigned char)*index)) {
+        // Skip to the n-th space-separated element
+        long n = strtol(index, NULL, 10);
+        while (1) {
+            value += strspn(value, " \t\n");
+            len = strcspn(value, " \t\n");
+            if (n-- == 0 || len == 0) break;
+            value += len;
+        }
+    }
+    lexer_append_fields(lexer, value, len, quoted);
+    return 0;
+}
+
+// Function to read a $(cmd) or `cmd` substitution, or a variable reference,
+// in a word. While parsing it only marks the word for expansion; when
+// expanding, it runs the command and adds its output, minus trailing
+// newlines. A $ that starts neither stays as it is. Returns -1 on a lexical
+// error.
+int lex_substitution(Lexer *lexer, int quoted) {
+    const char *start;
+    const char *stop;
+    int backquoted = *lexer->pos == '`';
+    if (!backquoted) {
+        char next = lexer->pos + 1 < lexer->end ? lexer->pos[1] : '\0';
+        if (next == '{' || is_special_parameter(next) || isalpha((unsigned char)next) || next == '_') {
+            return lex_variable(lexer, quoted);
+        }
+        if (next != '(') {
+            lexer_append(lexer, "$", 1);
+            lexer->pos++;
+            return 0;
+        }
+        start = lexer->pos + 2;
+        stop = find_closing_paren(start, lexer->end);
+        if (!stop) {
+            fprintf(stderr, "Error: Unmatched (\n");
+            return -1;
+        }
+    } else {
+        start = lexer->pos + 1;
+        stop = start;
+        while (stop < lexer->end && *stop != '`') {
+            stop += *stop == '\\' ? 2 : 1;
+        }
+        if (stop >= lexer->end) {
+            fprintf(stderr, "Error: Unmatched `\n");
+            return -1;
+        }
+    }
+    lexer->pos = stop + 1;
+    
+    if (!lexer->expand) {
+        lexer->needs_expansion = 1;
+        return 0;
+    }
+    
+    // Inside backquotes a backslash only escapes $, ` and itself
+    char *command = arena_strndup(&line_arena, start, stop - start);
+    if (backquoted) {
+        char *out = command;
+        for (char *in = command; *in; in++) {
+            if (*in == '\\' && (in[1] == '$' || in[1] == '`' || in[1] == '\\')) in++;
+            *out++ = *in;
+        }
+        *out = '\0';
+    }
+    
+    OutBuf out = {0};
+    capture_command(command, &out);
+    while (out.len > 0 && out.data[out.len - 1] == '\n') {
+        out.len--;
+    }
+    lexer_append_fields(lexer, out.data, out.len, quoted);
+    outbuf_free(&out);
+    return 0;
+}
+
+// Function to read one word, joining adjacent quoted and unquoted parts
+int lex_word(Lexer *lexer, Token *token) {
+    lexer->word_len = 0;
+    lexer->needs_expansion = 0;
+    lexer->field_started = 0;
+    
+    while (lexer->pos < lexer->end) {
+        char c = *lexer->pos;
+        
+        if (c == '\'') {
+            // Single quotes: everything up to the closing quote is literal
+            const char *close = memchr(lexer->pos + 1, '\'', lexer->end - lexer->pos - 1);
+            if (!close) {
+                fprintf(stderr, "Error: Unmatched '\n");
+                return -1;
+            }
+            lexer_append(lexer, lexer->pos + 1, close - lexer->pos - 1);
+            lexer->pos = close + 1;
+            lexer->field_started = 1;
+        } else if (c == '"') {
+            // Double quotes: backslash only escapes \ $ " and newline
+            lexer->pos++;
+            lexer->field_started = 1;
+            while (1) {
+                const char *special = scan_dquote_chars(lexer->pos, lexer->end);
+                lexer_append(lexer, lexer->pos, special - lexer->pos);
+                lexer->pos = special;
+                
+                if (lexer->pos >= lexer->end) {
+                    fprintf(stderr, "Error: Unmatched \"\n");
+                    return -1;
+                }
+                if (*lexer->pos == '"') {
+                    lexer->pos++;  // Skip closing quote
+                    break;
+                }
+                if (*lexer->pos == '$' || *lexer->pos == '`') {
+                    if (lex_substitution(lexer, 1) != 0) {
+                        return -1;
+                    }
+                    continue;
+                }
+                
+                // Handle backslash in double quotes
+                lexer->pos++;
+                if (lexer->pos >= lexer->end) {
+                    fprintf(stderr, "Error: Unmatched backslash\n");
+                    return -1;
+                }
+                c = *lexer->pos++;
+                if (c == '\\' || c == '$' || c == '"' || c == '\n') {
+                    lexer_append(lexer, &c, 1);
+                } else {
+                    // For other characters, keep the backslash and the character
+                    lexer_append(lexer, "\\", 1);
+                    lexer_append(lexer, &c, 1);
+                }
+            }
+        } else if (c == '\\') {
+            // Unquoted backslash preserves the next character
+            lexer->pos++;
+            if (lexer->pos >= lexer->end) {
+                fprintf(stderr, "Error: Unmatched backslash\n");
+                return -1;
+            }
+            if (*lexer->pos != '\n') {
+                lexer_append(lexer, lexer->pos, 1);
+            }
+            lexer->pos++;  // A backslash-newline is a line continuation
+        } else if (c == '$' || c == '`') {
+            if (lex_substitution(lexer, 0) != 0) {
+                return -1;
+            }
+        } else if (is_blank(c) || c == '|' || c == '<' || c == '>' || c == '&' || c == ';') {
+            break;
+        } else {
+            // Copy a whole run of ordinary characters at once
+            const char *special = scan_word_chars(lexer->pos, lexer->end);
+            lexer_append(lexer, lexer->pos, special - lexer->pos);
+            lexer->pos = special;
+        }
+    }
+    
+    lexer->word[lexer->word_len] = '\0';
+    token->type = TOKEN_WORD;
+    token->text = lexer->word;
+    return 0;
+}
+
+// Function to read the next token from the line. Returns -1 on a lexical error.
+int lexer_next(Lexer *lexer, Token *token) {
+    // Skip blanks between tokens
+    while (lexer->pos < lexer->end && is_blank(*lexer->pos)) {
+        lexer->pos++;
+    }
+    
+    lexer->token_start = lexer->pos;
+    
+    // A comment runs to the end of the line
+    if (lexer->pos < lexer->end && *lexer->pos == '#') {
+        lexer->pos = lexer->end;
+    }
+    
+    if (lexer->pos >= lexer->end) {
+        token->type = TOKEN_END;
+        return 0;
+    }
+    
+    if (*lexer->pos == '|') {
+        lexer->pos++;
+        token->type = TOKEN_PIPE;
+        return 0;
+    }
+    if (*lexer->pos == '&') {
+        // &> and &>> send both stdout and stderr to a file
+        if (lexer->pos + 1 < lexer->end && lexer->pos[1] == '>') {
+            int append = lexer->pos + 2 < lexer->end && lexer->pos[2] == '>';
+            token->type = TOKEN_REDIRECT;
+            token->op = append ? REDIR_OP_ANDDGREAT : REDIR_OP_ANDGREAT;
+            token->fd = STDOUT_FILENO;
+            token->fd_given = 0;
+            lexer->pos += 2 + append;
+            return 0;
+        }
+        lexer->pos++;
+        token->type = TOKEN_AMP;
+        return 0;
+    }
+    if (*lexer->pos == ';') {
+        lexer->pos++;
+        token->type = TOKEN_SEMI;
+        return 0;
+    }
+    
+    // Process substitution: <(cmd) or >(cmd), up to the matching parenthesis
+    if ((*lexer->pos == '<' || *lexer->pos == '>') && lexer->pos + 1 < lexer->end && lexer->pos[1] == '(') {
+        const char *close = find_closing_paren(lexer->pos + 2, lexer->end);
+        if (!close) {
+            fprintf(stderr, "Error: Unmatched (\n");
+            return -1;
+        }
+        token->type = TOKEN_SUBST;
+        token->subst_output = *lexer->pos == '>';
+        token->text = arena_strndup(&line_arena, lexer->pos + 2, close - lexer->pos - 2);
+        lexer->pos = close + 1;
+        return 0;
+    }
+    
+    // A redirection, optionally preceded by the descriptor number
+    const char *p = lexer->pos;
+    long fd = 0;
+    while (p < lexer->end && *p >= '0' && *p <= '9') {
+        if (fd <= INT32_MAX) fd = fd * 10 + (*p - '0');
+        p++;
+    }
+    if (p < lexer->end && (*p == '>' || *p == '<')) {
+        char c = *p++;
+        char next = p < lexer->end ? *p : '\0';
+        if (c == '>') {
+            token->op = REDIR_OP_GREAT;
+            if (next == '>') {
+                token->op = REDIR_OP_DGREAT;
+            } else if (next == '&') {
+                token->op = REDIR_OP_GREATAND;
+            }
+            if (next == '>' || next == '&' || next == '|') p++;  // >| is plain >
+        } else {
+            token->op = REDIR_OP_LESS;
+            if (next == '>') {
+                token->op = REDIR_OP_LESSGREAT;
+            } else if (next == '&') {
+                token->op = REDIR_OP_LESSAND;
+            } else if (next == '<') {
+                char after = p + 1 < lexer->end ? p[1] : '\0';
+                token->op = after == '<' ? REDIR_OP_TLESS : after == '-' ? REDIR_OP_DLESSDASH : REDIR_OP_DLESS;
+                if (after == '<' || after == '-') p++;
+            }
+            if (next == '>' || next == '&' || next == '<') p++;
+        }
+        
+        token->type = TOKEN_REDIRECT;
+        token->fd_given = *lexer->pos != c;
+        if (!token->fd_given) {
+            fd = c == '>' ? STDOUT_FILENO : STDIN_FILENO;
+        } else if (fd > INT32_MAX) {
+            fprintf(stderr, "%.*s: file descriptor out of range\n", (int)(p - lexer->pos), lexer->pos);
+            return -1;
+        }
+        token->fd = (int)fd;
+        lexer->pos = p;
+        return 0;
+    }
+    
+    return lex_word(lexer, token);
+}
+
+// Function to report a token the parser did not expect
+void syntax_error(Token *token) {
+    const char *text = "newline";
+    if (token->type == TOKEN_PIPE) {
+        text = "|";
+    } else if (token->type == TOKEN_AMP) {
+        text = "&";
+    } else if (token->type == TOKEN_SEMI) {
+        text = ";";
+    } else if (token->type == TOKEN_REDIRECT) {
+        text = redir_op_text[token->op];
+    }
+    fprintf(stderr, "syntax error near unexpected token `%s'\n", text);
+}
+
+// Function to start a new, empty command at the end of a pipeline
+SimpleCommand* add_command(Pipeline *pipeline, int *capacity) {
+    if (pipeline->num_commands >= *capacity) {
+        pipeline->commands = arena_realloc(&line_arena, pipeline->commands,
+                                           *capacity * sizeof(SimpleCommand),
+                                           *capacity * 2 * sizeof(SimpleCommand));
+        *capacity *= 2;
+    }
+    
+    SimpleCommand *cmd = &pipeline->commands[pipeline->num_commands++];
+    cmd->arg_capacity = 8;
+    cmd->args = arena_alloc(&line_arena, cmd->arg_capacity * sizeof(char*));
+    cmd->args[0] = NULL;
+    cmd->arg_count = 0;
+    cmd->redirs = NULL;
+    cmd->num_redirs = 0;
+    cmd->redir_capacity = 0;
+    cmd->substs = NULL;
+    cmd->num_substs = 0;
+    cmd->expansions = NULL;
+    cmd->num_expansions = 0;
+    cmd->assigns = NULL;
+    cmd->num_assigns = 0;
+    cmd->expanded = 0;
+    return cmd;
+}
+
+// Function to add a redirection to a command
+void add_redirection(SimpleCommand *cmd, int fd, RedirType type, const char *filename, int src_fd) {
+    if (cmd->num_redirs >= cmd->redir_capacity) {
+        int capacity = cmd->redir_capacity ? cmd->redir_capacity * 2 : 4;
+        cmd->redirs = arena_realloc(&line_arena, cmd->redirs,
+                                    cmd->redir_capacity * sizeof(Redirection),
+                                    capacity * sizeof(Redirection));
+        cmd->redir_capacity = capacity;
+    }
+    
+    Redirection *redir = &cmd->redirs[cmd->num_redirs];
+    redir->fd = fd;
+    redir->type = type;
+    redir->filename = filename ? arena_strdup(&line_arena, filename) : NULL;
+    redir->src_fd = src_fd;
+    redir->expand = 0;
+    redir->heredoc = NULL;
+    cmd->num_redirs++;
+}
+
+// Function to add a word with substitutions as the command's next argument,
+// kept as its source text until the command runs
+void add_expansion(SimpleCommand *cmd, const char *raw, size_t len) {
+    add_argument(cmd, raw, len);
+    cmd->expansions = arena_realloc(&line_arena, cmd->expansions,
+                                    cmd->num_expansions * sizeof(int),
+                                    (cmd->num_expansions + 1) * sizeof(int));
+    cmd->expansions[cmd->num_expansions++] = cmd->arg_count - 1;
+}
+
+// Function to check whether a word's source text is a NAME=value assignment
+int is_assignment(const char *start, const char *end) {
+    const char *equals = memchr(start, '=', end - start);
+    return equals && is_valid_name(start, equals - start);
+}
+
+// Function to add a NAME=value assignment to a command, kept as its source
+// text until the command runs
+void add_assignment(SimpleCommand *cmd, const char *raw, size_t len) {
+    cmd->assigns = arena_realloc(&line_arena, cmd->assigns,
+                                 cmd->num_assigns * sizeof(char*),
+                                 (cmd->num_assigns + 1) * sizeof(char*));
+    cmd->assigns[cmd->num_assigns++] = arena_strndup(&line_arena, raw, len);
+}
+
+// Function to add a process substitution as the command's next argument.
+// The argument is filled in with /dev/fd/N when the command runs.
+void add_substitution(SimpleCommand *cmd, int output, char *command) {
+    add_argument(cmd, "", 0);
+    cmd->substs = arena_realloc(&line_arena, cmd->substs,
+                                cmd->num_substs * sizeof(ProcSubst),
+                                (cmd->num_substs + 1) * sizeof(ProcSubst));
+    ProcSubst *subst = &cmd->substs[cmd->num_substs++];
+    subst->arg_index = cmd->arg_count - 1;
+    subst->output = output;
+    subst->command = command;
+}
+
+// Function to check for a word made only of digits
+int is_number(const char *word) {
+    if (*word == '\0') return 0;
+    for (; *word; word++) {
+        if (*word < '0' || *word > '9') return 0;
+    }
+    return 1;
+}
+
+// Function to add a here-document or here-string redirection. A
+// here-document's body is read once the rest of the line has been parsed.
+void add_heredoc(Lexer *lexer, SimpleCommand *cmd, Token *op, const char *word) {
+    HereDoc *heredoc = arena_alloc(&line_arena, sizeof(HereDoc));
+    heredoc->strip_tabs = op->op == REDIR_OP_DLESSDASH;
+    heredoc->expand = 0;
+    
+    if (op->op == REDIR_OP_TLESS) {
+        // A here-string is the word plus a newline
+        heredoc->delimiter = NULL;
+        heredoc->len = strlen(word) + 1;
+        heredoc->body = arena_alloc(&line_arena, heredoc->len + 1);
+        memcpy(heredoc->body, word, heredoc->len - 1);
+        heredoc->body[heredoc->len - 1] = '\n';
+        heredoc->body[heredoc->len] = '\0';
+    } else {
+        heredoc->delimiter = arena_strdup(&line_arena, word);
+        heredoc->body = NULL;
+        heredoc->len = 0;
+        
+        if (lexer->num_heredocs >= lexer->heredoc_capacity) {
+            int new_capacity = lexer->heredoc_capacity ? lexer->heredoc_capacity * 2 : 4;
+            lexer->heredocs = arena_realloc(&line_arena, lexer->heredocs,
+                                            lexer->heredoc_capacity * sizeof(HereDoc*),
+                                            new_capacity * sizeof(HereDoc*));
+            lexer->heredoc_capacity = new_capacity;
+        }
+        lexer->heredocs[lexer->num_heredocs++] = heredoc;
+    }
+    
+    add_redirection(cmd, op->fd, REDIR_HEREDOC, NULL, -1);
+    cmd->redirs[cmd->num_redirs - 1].heredoc = heredoc;
+}
+
+// Function to read the bodies of the line's here-documents, in order, from
+// the lines that follow it
+void read_heredoc_bodies(Lexer *lexer) {
+    for (int i = 0; i < lexer->num_heredocs; i++) {
+        HereDoc *heredoc = lexer->heredocs[i];
+        size_t capacity = 256;
+        heredoc->body = arena_alloc(&line_arena, capacity);
+        
+        while (1) {
+            char *line = read_input_line ? read_input_line("> ") : NULL;
+            if (!line) {
+                fprintf(stderr, "warning: here-document delimited by end-of-file (wanted `%s')\n", heredoc->delimiter);
+                break;
+            }
+            if (heredoc->strip_tabs) {
+                while (*line == '\t') line++;
+            }
+            if (strcmp(line, heredoc->delimiter) == 0) {
+                break;
+            }
+            
+            size_t len = strlen(line);
+            if (heredoc->len + len + 2 > capacity) {
+                size_t new_capacity = capacity * 2;
+                while (heredoc->len + len + 2 > new_capacity) new_capacity *= 2;
+                heredoc->body = arena_realloc(&line_arena, heredoc->body, capacity, new_capacity);
+                capacity = new_capacity;
+            }
+            memcpy(heredoc->body + heredoc->len, line, len);
+            heredoc->len += len;
+            heredoc->body[heredoc->len++] = '\n';
+        }
+        heredoc->body[heredoc->len] = '\0';
+    }
+    lexer->num_heredocs = 0;
+}
+
+// Function to add the redirections for an operator and the word after it.
+// Returns -1 (after printing an error) if the combination makes no sense.
+int add_redirection_op(Lexer *lexer, SimpleCommand *cmd, Token *op, const char *word) {
+    if (op->op == REDIR_OP_DLESS || op->op == REDIR_OP_DLESSDASH || op->op == REDIR_OP_TLESS) {
+        add_heredoc(lexer, cmd, op, word);
+    } else if (op->op == REDIR_OP_GREAT) {
+        add_redirection(cmd, op->fd, REDIR_OUTPUT, word, -1);
+    } else if (op->op == REDIR_OP_DGREAT) {
+        add_redirection(cmd, op->fd, REDIR_APPEND, word, -1);
+    } else if (op->op == REDIR_OP_LESS) {
+        add_redirection(cmd, op->fd, REDIR_INPUT, word, -1);
+    } else if (op->op == REDIR_OP_LESSGREAT) {
+        add_redirection(cmd, op->fd, REDIR_READWRITE, word, -1);
+    } else if ((op->op == REDIR_OP_GREATAND || op->op == REDIR_OP_LESSAND) && strcmp(word, "-") == 0) {
+        add_redirection(cmd, op->fd, REDIR_CLOSE, NULL, -1);
+    } else if ((op->op == REDIR_OP_GREATAND || op->op == REDIR_OP_LESSAND) && is_number(word) && strlen(word) < 10) {
+        add_redirection(cmd, op->fd, REDIR_DUP, NULL, atoi(word));
+    } else if (op->op == REDIR_OP_LESSAND || (op->op == REDIR_OP_GREATAND && op->fd_given)) {
+        fprintf(stderr, "%s: ambiguous redirect\n", word);
+        return -1;
+    } else {
+        // &>file, &>>file and >&file: stdout to the file, then stderr to stdout
+        add_redirection(cmd, STDOUT_FILENO, op->op == REDIR_OP_ANDDGREAT ? REDIR_APPEND : REDIR_OUTPUT, word, -1);
+        add_redirection(cmd, STDERR_FILENO, REDIR_DUP, NULL, STDOUT_FILENO);
+    }
+    return 0;
+}
+
+// Function to parse one pipeline, up to the ;, & or end of line that ends
+// it. Returns NULL (after printing an error) if the pipeline is malformed.
+Pipeline* parse_pipeline(Lexer *lexer, TokenType *terminator) {
+    int capacity = 4;
+    Pipeline *pipeline = arena_alloc(&line_arena, sizeof(Pipeline));
+    pipeline->commands = arena_alloc(&line_arena, capacity * sizeof(SimpleCommand));
+    pipeline->num_commands = 0;
+    pipeline->background = 0;
+    pipeline->timed = 0;
+    pipeline->text = NULL;
+    pipeline->text_len = 0;
+    SimpleCommand *cmd = add_command(pipeline, &capacity);
+    
+    while (1) {
+        Token token;
+        if (lexer_next(lexer, &token) != 0) {
+            return NULL;
+        }
+        if (!pipeline->text) {
+            pipeline->text = lexer->token_start;
+        }
+        
+        // The time keyword can only start the pipeline, and only unquoted
+        int at_start = pipeline->num_commands == 1 && cmd->arg_count == 0 &&
+                       cmd->num_assigns == 0 && cmd->num_redirs == 0;
+        if (token.type == TOKEN_WORD && at_start && !pipeline->timed &&
+            lexer->pos - lexer->token_start == 4 && strcmp(token.text, "time") == 0) {
+            pipeline->timed = 1;
+        } else if (token.type == TOKEN_WORD && cmd->arg_count == 0 &&
+                   is_assignment(lexer->token_start, lexer->pos)) {
+            add_assignment(cmd, lexer->token_start, lexer->pos - lexer->token_start);
+        } else if (token.type == TOKEN_WORD && lexer->needs_expansion) {
+            add_expansion(cmd, lexer->token_start, lexer->pos - lexer->token_start);
+        } else if (token.type == TOKEN_WORD) {
+            add_argument(cmd, token.text, lexer->word_len);
+        } else if (token.type == TOKEN_SUBST) {
+            add_substitution(cmd, token.subst_output, token.text);
+        } else if (token.type == TOKEN_REDIRECT) {
+            Token target;
+            if (lexer_next(lexer, &target) != 0) {
+                return NULL;
+            }
+            if (target.type != TOKEN_WORD) {
+                syntax_error(&target);
+                return NULL;
+            }
+            
+            // A file name or here-string with substitutions is expanded when
+            // the command runs; so is a here-document unless its delimiter is quoted
+            int heredoc = token.op == REDIR_OP_DLESS || token.op == REDIR_OP_DLESSDASH;
+            int expand = lexer->needs_expansion && !heredoc;
+            const char *word = target.text;
+            if (expand) {
+                word = arena_strndup(&line_arena, lexer->token_start, lexer->pos - lexer->token_start);
+            }
+            int first_redir = cmd->num_redirs;
+            if (add_redirection_op(lexer, cmd, &token, word) != 0) {
+                return NULL;
+            }
+            for (int i = first_redir; expand && i < cmd->num_redirs; i++) {
+                if (cmd->redirs[i].filename) cmd->redirs[i].expand = 1;
+            }
+            if (heredoc || token.op == REDIR_OP_TLESS) {
+                int quoted = scan_special(lexer->token_start, lexer->pos, &quote_scan_set) < lexer->pos;
+                cmd->redirs[cmd->num_redirs - 1].heredoc->expand = heredoc ? !quoted : expand;
+            }
+        } else {
+            // A pipe, a separator or the end of the line finishes the current command
+            int empty = cmd->arg_count == 0 && cmd->num_redirs == 0 && cmd->num_assigns == 0;
+            if (token.type == TOKEN_PIPE) {
+                if (empty) {
+                    syntax_error(&token);
+                    return NULL;
+                }
+                cmd = add_command(pipeline, &capacity);
+            } else {
+                // Only the end of the line may follow nothing at all
+                if (empty && (pipeline->num_commands > 1 || token.type != TOKEN_END)) {
+                    syntax_error(&token);
+                    return NULL;
+                }
+                
+                // Keep the source text, minus trailing blanks, for the job table
+                size_t len = lexer->token_start - pipeline->text;
+                while (len > 0 && is_blank(pipeline->text[len - 1])) {
+                    len--;
+                }
+                pipeline->text_len = len;
+                pipeline->background = token.type == TOKEN_AMP;
+                *terminator = token.type;
+                return pipeline;
+            }
+        }
+    }
+}
+
+// Function to parse a command line into its pipelines in a single pass over
+// the input. Returns NULL (after printing an error) if the line is malformed,
+// in which case none of it runs.
+CommandList* parse_command_list(const char *input) {
+    Lexer lexer;
+    lexer.pos = input;
+    lexer.end = input + strlen(input);
+    lexer.token_start = input;
+    lexer.word_capacity = lexer.end - lexer.pos + 1;
+    lexer.word = arena_alloc(&line_arena, lexer.word_capacity);
+    lexer.heredocs = NULL;
+    lexer.num_heredocs = 0;
+    lexer.heredoc_capacity = 0;
+    lexer.expand = 0;
+    lexer.fields = NULL;
+    
+    CommandList *list = arena_alloc(&line_arena, sizeof(CommandList));
+    list->capacity = 4;
+    list->pipelines = arena_alloc(&line_arena, list->capacity * sizeof(Pipeline*));
+    list->count = 0;
+    
+    while (1) {
+        TokenType terminator;
+        Pipeline *pipeline = parse_pipeline(&lexer, &terminator);
+        if (!pipeline) {
+            return NULL;
+        }
+        
+        // An empty pipeline can only be the end of the line
+        SimpleCommand *first = &pipeline->commands[0];
+        if (pipeline->num_commands == 1 && first->arg_count == 0 && first->num_redirs == 0 &&
+            first->num_assigns == 0 && !pipeline->timed) {
+            break;
+        }
+        
+        if (list->count >= list->capacity) {
+            list->pipelines = arena_realloc(&line_arena, list->pipelines,
+                                            list->capacity * sizeof(Pipeline*),
+                                            list->capacity * 2 * sizeof(Pipeline*));
+            list->capacity *= 2;
+        }
+        list->pipelines[list->count++] = pipeline;
+        
+        if (terminator == TOKEN_END) {
+            break;
+        }
+    }
+    
+    read_heredoc_bodies(&lexer);
+    return list;
+}
+
+// Function to get the kernel's limit on argument plus environment size
+long arg_max_limit(void) {
+    static long arg_max = 0;
+    if (arg_max == 0) {
+        arg_max = sysconf(_SC_ARG_MAX);
+        if (arg_max <= 0) arg_max = 131072;  // POSIX minimum is far lower; this is Linux's floor
+    }
+    return arg_max;
+}
+
+// Function to get the space one string takes in a new process's argv or envp
+size_t exec_string_space(const char *str) {
+    return strlen(str) + 1 + sizeof(char*);
+}
+
+// Function to get the space an environment takes in a new process
+size_t environment_space(char **envp) {
+    size_t total = sizeof(char*);
+    for (char **env = envp; *env != NULL; env++) {
+        total += exec_string_space(*env);
+    }
+    return total;
+}
+
+// Function to check an argument list against the exec limits. Prints an
+// E2BIG diagnostic and returns -1 if the command could not be started.
+int check_exec_size(char **args, char **envp) {
+    // Linux also caps each single string at 32 pages (MAX_ARG_STRLEN)
+    size_t max_string = 32 * (size_t)sysconf(_SC_PAGESIZE);
+    size_t total = environment_space(envp) + sizeof(char*);
+    int count = 0;
+    
+    for (; args[count] != NULL; count++) {
+        size_t len = strlen(args[count]) + 1;
+        if (len > max_string) {
+            fprintf(stderr, "%s: %s (argument %d is %zu bytes, limit %zu)\n",
+                    args[0], strerror(E2BIG), count, len, max_string);
+            return -1;
+        }
+        total += len + sizeof(char*);
+    }
+    
+    if (total > (size_t)arg_max_limit()) {
+        fprintf(stderr, "%s: %s (%d arguments, %zu bytes with environment, limit %ld)\n",
+                args[0], strerror(E2BIG), count, total, arg_max_limit());
+        return -1;
+    }
+    return 0;
+}
+
+// Function to fill in the signals the shell catches or ignores for itself,
+// which every child gets back at their defaults
+void shell_signal_set(sigset_t *set) {
+    sigemptyset(set);
+    sigaddset(set, SIGCHLD);
+    sigaddset(set, SIGTSTP);
+    sigaddset(set, SIGTTIN);
+    sigaddset(set, SIGTTOU);
+}
+
+// Function to restore default signal handling in a forked child
+void reset_child_signals(void) {
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+}
+
+// Function to start an external command with the given environment and descriptor setup.
+// With pgid >= 0 the child joins that process group (0 starts a new one led
+// by the child). Returns the child's pid, or -1 if it could not be started.
+pid_t spawn_command(const char *exec_path, char **args, char **envp, SpawnAction *actions, int num_actions, pid_t pgid) {
+    if (check_exec_size(args, envp) != 0) {
+        return -1;
+    }
+    
+    if (spawn_backend == SPAWN_BACKEND_POSIX) {
+        posix_spawn_file_actions_t file_actions;
+        int err = posix_spawn_file_actions_init(&file_actions);
+        if (err != 0) {
+            fprintf(stderr, "posix_spawn failed: %s\n", strerror(err));
+            return -1;
+        }
+        
+        for (int i = 0; i < num_actions && err == 0; i++) {
+            if (actions[i].type == SPAWN_OPEN) {
+                err = posix_spawn_file_actions_addopen(&file_actions, actions[i].fd,
+                                                       actions[i].path, actions[i].flags, 0666);
+            } else if (actions[i].type == SPAWN_DUP2) {
+                err = posix_spawn_file_actions_adddup2(&file_actions, actions[i].src_fd, actions[i].fd);
+            } else if (actions[i].type == SPAWN_CLOSE) {
+                err = posix_spawn_file_actions_addclose(&file_actions, actions[i].fd);
+            } else {
+                // Without this, the parent's tcsetpgrp after the spawn has to do
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+                err = posix_spawn_file_actions_addtcsetpgrp_np(&file_actions, actions[i].fd);
+#endif
+            }
+        }
+        
+        // The child starts with default signal handling, in its job's process group
+        posix_spawnattr_t attr;
+        sigset_t defaults;
+        shell_signal_set(&defaults);
+        short flags = POSIX_SPAWN_SETSIGDEF;
+        if (pgid >= 0) flags |= POSIX_SPAWN_SETPGROUP;
+        if (err == 0) err = posix_spawnattr_init(&attr);
+        if (err == 0) {
+            posix_spawnattr_setsigdefault(&attr, &defaults);
+            posix_spawnattr_setpgroup(&attr, pgid >= 0 ? pgid : 0);
+            posix_spawnattr_setflags(&attr, flags);
+        }
+        
+        pid_t pid = -1;
+        long long spawn_start = trace_clock();
+        if (err == 0) {
+            err = posix_spawn(&pid, exec_path, &file_actions, &attr, args, envp);
+            posix_spawnattr_destroy(&attr);
+        }
+        posix_spawn_file_actions_destroy(&file_actions);
+        
+        if (err != 0) {
+            fprintf(stderr, "%s: %s\n", args[0], strerror(err));
+            return -1;
+        }
+        
+        // glibc's posix_spawn returns once the child has exec'd
+        trace_event(TRACE_SPAWN, spawn_start, pid, 0, args[0], strlen(args[0]));
+        trace_event(TRACE_EXEC, 0, pid, 0, exec_path, strlen(exec_path));
+        return pid;
+    }
+    
+    long long fork_start = trace_clock();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        return -1;
+    }
+    
+    if (pid == 0) {
+        if (pgid >= 0) setpgid(0, pgid);
+        
+        // Child process: apply descriptor setup in order
+        for (int i = 0; i < num_actions; i++) {
+            if (actions[i].type == SPAWN_OPEN) {
+                int fd = open(actions[i].path, actions[i].flags, 0666);
+                if (fd == -1) {
+                    fprintf(stderr, "open failed for %s: %s\n", actions[i].path, strerror(errno));
+                    exit(1);
+                }
+                if (fd != actions[i].fd) {
+                    if (dup2(fd, actions[i].fd) == -1) {
+                        fprintf(stderr, "dup2 failed: %s\n", strerror(errno));
+                        exit(1);
+                    }
+                    close(fd);
+                }
+            } else if (actions[i].type == SPAWN_DUP2) {
+                if (dup2(actions[i].src_fd, actions[i].fd) == -1) {
+                    fprintf(stderr, "dup2 failed: %s\n", strerror(errno));
+                    exit(1);
+                }
+                
+                // dup2 onto itself leaves close-on-exec set
+                if (actions[i].src_fd == actions[i].fd) {
+                    fcntl(actions[i].fd, F_SETFD, 0);
+                }
+            } else if (actions[i].type == SPAWN_CLOSE) {
+                close(actions[i].fd);
+            } else {
+                tcsetpgrp(actions[i].fd, getpgrp());  // SIGTTOU is still ignored here
+            }
+        }
+        reset_child_signals();
+        
+        // The parent's ring is lost at exec, so this event is written straight away
+        if (trace_ring) {
+            OutBuf out = {0};
+            format_trace_event(&out, TRACE_EXEC, monotonic_ns(), 0, getpid(), 0, exec_path);
+            outbuf_flush(&out, trace_fd);
+        }
+        
+        // Execute the command
+        execve(exec_path, args, envp);
+        
+        // If execv returns, it failed
+        fprintf(stderr, "execve failed for %s: %s\n", exec_path, strerror(errno));
+        exit(1);
+    }
+    
+    // Set the group from the parent too, so it exists before anyone uses it
+    if (pgid >= 0) setpgid(pid, pgid ? pgid : pid);
+    trace_event(TRACE_FORK, fork_start, pid, 0, args[0], strlen(args[0]));
+    return pid;
+}
+
+// Function to create a close-on-exec pipe with the configured capacity.
+// Returns -1 if the pipe can't be created; a capacity the kernel refuses
+// leaves the default in place.
+int make_pipe(int fds[2]) {
+    long long start = trace_clock();
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    if (pipe_size > 0) {
+        fcntl(fds[1], F_SETPIPE_SZ, (int)pipe_size);
+    }
+    trace_event(TRACE_PIPE, start, 0, 0, NULL, 0);
+    return 0;
+}
+
+// Function to add one item to a batch. Returns -1 if out of memory.
+int batch_add_item(BatchItems *items, const char *item, size_t len) {
+    if (items->used + len + 1 > items->capacity) {
+        size_t new_capacity = items->capacity ? items->capacity * 2 : 65536;
+        while (new_capacity < items->used + len + 1) new_capacity *= 2;
+        char *data = realloc(items->data, new_capacity);
+        if (!data) return -1;
+        items->data = data;
+        items->capacity = new_capacity;
+    }
+    if (items->count >= items->offset_capacity) {
+        int new_capacity = items->offset_capacity ? items->offset_capacity * 2 : 1024;
+        size_t *offsets = realloc(items->offsets, new_capacity * sizeof(size_t));
+        if (!offsets) return -1;
+        items->offsets = offsets;
+        items->offset_capacity = new_capacity;
+    }
+    
+    items->offsets[items->count++] = items->used;
+    memcpy(items->data + items->used, item, len);
+    items->data[items->used + len] = '\0';
+    items->used += len + 1;
+    items->space += len + 1 + sizeof(char*);
+    return 0;
+}
+
+// Function to wait for the oldest running batch and record its status
+void batch_wait_oldest(pid_t *running, int *num_running, int *status) {
+    int child_status;
+    if (waitpid(running[0], &child_status, 0) > 0) {
+        if (!WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+            *status = 123;  // Same convention as xargs
+        }
+    }
+    memmove(running, running + 1, (*num_running - 1) * sizeof(pid_t));
+    (*num_running)--;
+}
+
+// Function to start one invocation of the batched command
+void batch_spawn(const char *exec_path, char **command, int num_fixed, BatchItems *items,
+                 pid_t *running, int *num_running, int max_procs, int *status) {
+    if (items->count == 0) return;
+    
+    char **argv = malloc((num_fixed + items->count + 1) * sizeof(char*));
+    if (!argv) {
+        perror("malloc failed");
+        *status = 1;
+        return;
+    }
+    memcpy(argv, command, num_fixed * sizeof(char*));
+    for (int i = 0; i < items->count; i++) {
+        argv[num_fixed + i] = items->data + items->offsets[i];
+    }
+    argv[num_fixed + items->count] = NULL;
+    
+    // Make room before starting another one
+    if (*num_running >= max_procs) {
+        batch_wait_oldest(running, num_running, status);
+    }
+    
+    // The command must not read the items we are still consuming
+    SpawnAction devnull = { .type = SPAWN_OPEN, .fd = STDIN_FILENO, .path = "/dev/null", .flags = O_RDONLY };
+    pid_t pid = spawn_command(exec_path, argv, shell_environment(), &devnull, 1, -1);
+    if (pid > 0) {
+        running[(*num_running)++] = pid;
+    } else {
+        *status = 1;
+    }
+    free(argv);
+    
+    items->used = 0;
+    items->count = 0;
+    items->space = 0;
+}
+
+// Handle the 'batch' builtin: batch [-0] [-P N] command [arg ...]
+// Reads items from stdin and runs command with as many of them per
+// invocation as fit in ARG_MAX, like xargs.
+int handle_batch(char **args) {
+    char delimiter = '\n';
+    int max_procs = 1;
+    int i = 1;
+    
+    // Parse options
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(args[i], "-0") == 0) {
+            delimiter = '\0';
+        } else if (strncmp(args[i], "-P", 2) == 0) {
+            const char *value = args[i][2] ? args[i] + 2 : args[++i];
+            max_procs = value ? atoi(value) : 0;
+            if (max_procs < 1) {
+                fprintf(stderr, "batch: -P: invalid number of processes\n");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "batch: %s: invalid option\n", args[i]);
+            fprintf(stderr, "batch: usage: batch [-0] [-P N] command [arg ...]\n");
+            return 1;
+        }
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "batch: usage: batch [-0] [-P N] command [arg ...]\n");
+        return 1;
+    }
+    
+    char **command = &args[i];
+    
+    // Resolve the command once for every invocation. Like xargs, batch only
+    // runs programs, so a name such as echo means the one in PATH.
+    char *exec_path = find_executable(command[0]);
+    if (!exec_path) {
+        fprintf(stderr, "batch: %s: command not found\n", command[0]);
+        return 127;
+    }
+    
+    // Space left for items once the environment and fixed arguments are in.
+    // Keep some headroom, as xargs does, for anything the kernel adds.
+    int num_fixed = 0;
+    long budget = arg_max_limit() - (long)environment_space(shell_environment()) - BATCH_HEADROOM - (long)sizeof(char*);
+    for (; command[num_fixed] != NULL; num_fixed++) {
+        budget -= (long)exec_string_space(command[num_fixed]);
+    }
+    if (budget <= 0) {
+        fprintf(stderr, "batch: %s: %s\n", command[0], strerror(E2BIG));
+        free(exec_path);
+        return 1;
+    }
+    size_t max_string = 32 * (size_t)sysconf(_SC_PAGESIZE);
+    
+    BatchItems items = {0};
+    char *item = NULL;       // Item being read, which may span reads
+    size_t item_len = 0;
+    size_t item_capacity = 0;
+    pid_t *running = malloc(max_procs * sizeof(pid_t));
+    int num_running = 0;
+    int status = 0;
+    char buffer[65536];
+    
+    if (!running) {
+        perror("malloc failed");
+        free(exec_path);
+        return 1;
+    }
+    
+    while (1) {
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("batch: read");
+            status = 1;
+        }
+        
+        // At end of input an unterminated last item still counts
+        ssize_t limit = n > 0 ? n : 0;
+        for (ssize_t pos = 0; pos <= limit; ) {
+            const char *delim = pos < limit ? memchr(buffer + pos, delimiter, limit - pos) : NULL;
+            size_t len = delim ? (size_t)(delim - (buffer + pos)) : (size_t)(limit - pos);
+            
+            if (item_len + len > item_capacity) {
+                size_t new_capacity = item_capacity ? item_capacity * 2 : 256;
+                while (new_capacity < item_len + len) new_capacity *= 2;
+                char *new_item = realloc(item, new_capacity);
+                if (!new_item) {
+                    perror("realloc failed");
+                    n = 0;
+                    status = 1;
+                    break;
+                }
+                item = new_item;
+                item_capacity = new_capacity;
+            }
+            memcpy(item + item_len, buffer + pos, len);
+            item_len += len;
+            pos += len + 1;
+            
+            // Only complete items (or the last one at EOF) go into a batch
+            if (!delim && n > 0) break;
+            if (item_len == 0) {
+                if (!delim) break;
+                continue;
+            }
+            
+            size_t space = item_len + 1 + sizeof(char*);
+            if (item_len + 1 > max_string || (long)space > budget) {
+                fprintf(stderr, "batch: item too long (%zu bytes); skipped\n", item_len);
+                status = 1;
+            } else {
+                if ((long)(items.space + space) > budget) {
+                    batch_spawn(exec_path, command, num_fixed, &items, running, &num_running, max_procs, &status);
+                }
+                if (batch_add_item(&items, item, item_len) != 0) {
+                    perror("malloc failed");
+                    status = 1;
+                }
+            }
+            item_len = 0;
+            if (!delim) break;
+        }
+        
+        if (n <= 0) break;
+    }
+    
+    // Run what's left and wait for everything
+    batch_spawn(exec_path, command, num_fixed, &items, running, &num_running, max_procs, &status);
+    while (num_running > 0) {
+        batch_wait_oldest(running, &num_running, &status);
+    }
+    
+    free(items.data);
+    free(items.offsets);
+    free(item);
+    free(running);
+    free(exec_path);
+    return status;
+}
+
+// Function to create a job for a pipeline with the given number of stages
+Job* job_create(int num_procs, const char *text, size_t text_len) {
+    Job *job = calloc(1, sizeof(Job));
+    if (!job) {
+        perror("malloc failed");
+        exit(1);
+    }
+    job->num_procs = num_procs;
+    job->pids = calloc(num_procs, sizeof(pid_t));
+    job->states = calloc(num_procs, sizeof(JobState));
+    job->statuses = calloc(num_procs, sizeof(int));
+    job->usage = calloc(num_procs, sizeof(struct rusage));
+    job->ended_ns = calloc(num_procs, sizeof(long long));
+    job->writers = calloc(num_procs, sizeof(PipeWriter*));
+    job->command = strndup(text ? text : "", text_len);
+    if (!job->pids || !job->states || !job->statuses || !job->usage || !job->ended_ns ||
+        !job->writers || !job->command) {
+        perror("malloc failed");
+        exit(1);
+    }
+    return job;
+}
+
+// Function to convert a wait status to a shell exit status
+int exit_status(int status) {
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+// Function to wait for the threads finishing a job's in-shell stages'
+// output, once its processes are done. A stage whose reader quit early gets
+// the status a forked one killed by SIGPIPE would have.
+void job_finish_writers(Job *job) {
+    for (int i = 0; i < job->num_procs; i++) {
+        PipeWriter *writer = job->writers[i];
+        if (!writer) continue;
+        pthread_join(writer->thread, NULL);
+        if (writer->broken) job->statuses[i] = W_EXITCODE(0, SIGPIPE);
+        free(writer);
+        job->writers[i] = NULL;
+    }
+}
+
+// Function to free a job, first reaping its process substitutions. Their
+// pipes are closed by now, so they finish on end of file or SIGPIPE.
+void job_free(Job *job) {
+    job_finish_writers(job);
+    for (int i = 0; i < job->num_substs; i++) {
+        int status;
+        while (waitpid(job->subst_pids[i], &status, 0) == -1 && errno == EINTR) {
+        }
+        trace_event(TRACE_REAP, 0, job->subst_pids[i], exit_status(status), NULL, 0);
+    }
+    free(job->subst_pids);
+    for (int i = 0; job->names && i < job->num_procs; i++) {
+        free(job->names[i]);
+    }
+    free(job->names);
+    free(job->usage);
+    free(job->ended_ns);
+    free(job->writers);
+    free(job->pids);
+    free(job->states);
+    free(job->statuses);
+    free(job->command);
+    free(job);
+}
+
+// Function to get the state of a job as a whole: running while any of its
+// processes run, then stopped while any are stopped
+JobState job_state(Job *job) {
+    JobState state = JOB_DONE;
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->states[i] == JOB_RUNNING) return JOB_RUNNING;
+        if (job->states[i] == JOB_STOPPED) state = JOB_STOPPED;
+    }
+    return state;
+}
+
+// Function to record a wait status, and the resources wait4 reported, for
+// one of a job's processes
+void job_record(Job *job, int i, int status, const struct rusage *usage) {
+    if (WIFSTOPPED(status)) {
+        job->states[i] = JOB_STOPPED;
+    } else if (WIFCONTINUED(status)) {
+        job->states[i] = JOB_RUNNING;
+    } else {
+        job->states[i] = JOB_DONE;
+        job->statuses[i] = status;
+        job->usage[i] = *usage;
+        job->ended_ns[i] = monotonic_ns();
+        trace_event(TRACE_REAP, 0, job->pids[i], exit_status(status), job->command, strlen(job->command));
+    }
+    job->notified = 0;
+}
+
+// Function to get the resources the shell itself used between two getrusage
+// calls, for a stage that ran in the shell
+void rusage_delta(struct rusage *delta, const struct rusage *before, const struct rusage *after) {
+    memset(delta, 0, sizeof(struct rusage));
+    timersub(&after->ru_utime, &before->ru_utime, &delta->ru_utime);
+    timersub(&after->ru_stime, &before->ru_stime, &delta->ru_stime);
+    delta->ru_maxrss = after->ru_maxrss;
+    delta->ru_minflt = after->ru_minflt - before->ru_minflt;
+    delta->ru_majflt = after->ru_majflt - before->ru_majflt;
+    delta->ru_nvcsw = after->ru_nvcsw - before->ru_nvcsw;
+    delta->ru_nivcsw = after->ru_nivcsw - before->ru_nivcsw;
+}
+
+// Function to add a time in the form bash's time keyword uses, e.g. 0m1.002s
+void print_time_line(OutBuf *out, const char *label, double seconds) {
+    int minutes = (int)(seconds / 60);
+    outbuf_printf(out, "%s\t%dm%.3fs\n", label, minutes, seconds - minutes * 60);
+}
+
+// Function to print the report for a timed pipeline to stderr: the totals,
+// then each stage's wall, user and sys time, max RSS, page faults and
+// voluntary/involuntary context switches
+void print_time_report(int num_stages, char **names, long long started_ns,
+                       const long long *ended_ns, const struct rusage *usage) {
+    // A pipeline's wall time runs until its last stage finished, which may
+    // be well before a background job is reported
+    struct timeval user = {0, 0};
+    struct timeval sys = {0, 0};
+    long long finished_ns = 0;
+    for (int i = 0; i < num_stages; i++) {
+        timeradd(&user, &usage[i].ru_utime, &user);
+        timeradd(&sys, &usage[i].ru_stime, &sys);
+        if (ended_ns[i] > finished_ns) finished_ns = ended_ns[i];
+    }
+    if (finished_ns == 0) finished_ns = monotonic_ns();
+    
+    OutBuf out = {0};
+    outbuf_puts(&out, "\n");
+    print_time_line(&out, "real", (finished_ns - started_ns) / 1e9);
+    print_time_line(&out, "user", user.tv_sec + user.tv_usec / 1e6);
+    print_time_line(&out, "sys", sys.tv_sec + sys.tv_usec / 1e6);
+    
+    outbuf_puts(&out, "stage\treal\tuser\tsys\tmaxrss\tminflt\tmajflt\tnvcsw\tnivcsw\n");
+    for (int i = 0; i < num_stages; i++) {
+        const struct rusage *ru = &usage[i];
+        double real = ended_ns[i] ? (ended_ns[i] - started_ns) / 1e9 : 0;
+        outbuf_printf(&out, "%d %s\t%.3f\t%.3f\t%.3f\t%ldK\t%ld\t%ld\t%ld\t%ld\n",
+                      i + 1, names[i] ? names[i] : "-", real,
+                      ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+                      ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+                      ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw);
+    }
+    outbuf_flush(&out, STDERR_FILENO);
+    outbuf_free(&out);
+}
+
+// Function to print a finished job's time report
+void print_job_times(Job *job) {
+    print_time_report(job->num_procs, job->names, job->started_ns, job->ended_ns, job->usage);
+}
+
+// Function to set PIPESTATUS from the wait statuses of a pipeline's stages
+void set_pipe_status(const int *statuses, int count) {
+    OutBuf value = {0};
+    for (int i = 0; i < count; i++) {
+        outbuf_printf(&value, i > 0 ? " %d" : "%d", exit_status(statuses[i]));
+    }
+    outbuf_append(&value, "", 1);
+    set_variable("PIPESTATUS", value.data, -1);
+    outbuf_free(&value);
+}
+
+// Function to add a job to the job table, numbering it after the newest job
+void job_add(Job *job) {
+    if (num_jobs >= job_capacity) {
+        int new_capacity = job_capacity ? job_capacity * 2 : 8;
+        Job **table = realloc(job_table, new_capacity * sizeof(Job*));
+        if (!table) {
+            perror("realloc failed");
+            exit(1);
+        }
+        job_table = table;
+        job_capacity = new_capacity;
+    }
+    job->id = num_jobs > 0 ? job_table[num_jobs - 1]->id + 1 : 1;
+    job_table[num_jobs++] = job;
+}
+
+// Function to take a job out of the job table (the job itself is kept)
+void job_remove(Job *job) {
+    for (int i = 0; i < num_jobs; i++) {
+        if (job_table[i] == job) {
+            memmove(&job_table[i], &job_table[i + 1], (num_jobs - i - 1) * sizeof(Job*));
+            num_jobs--;
+            break;
+        }
+    }
+    job->id = 0;
+}
+
+// Function to find a job from a %n, %%, %+ or %- spec, or the current job
+// when spec is NULL
+Job* job_find(const char *spec) {
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        return num_jobs > 0 ? job_table[num_jobs - 1] : NULL;
+    }
+    if (strcmp(spec, "%-") == 0) {
+        return num_jobs > 1 ? job_table[num_jobs - 2] : NULL;
+    }
+    if (spec[0] == '%') {
+        int id = atoi(spec + 1);
+        for (int i = 0; i < num_jobs; i++) {
+            if (job_table[i]->id == id) return job_table[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to add one line of job status, as the jobs builtin shows it
+void print_job(Job *job, OutBuf *out) {
+    char marker = ' ';
+    if (num_jobs > 0 && job == job_table[num_jobs - 1]) {
+        marker = '+';
+    } else if (num_jobs > 1 && job == job_table[num_jobs - 2]) {
+        marker = '-';
+    }
+    
+    char state[32];
+    JobState js = job_state(job);
+    int status = job->statuses[job->num_procs - 1];
+    if (js == JOB_RUNNING) {
+        snprintf(state, sizeof(state), "Running");
+    } else if (js == JOB_STOPPED) {
+        snprintf(state, sizeof(state), "Stopped");
+    } else if (job->pids[job->num_procs - 1] > 0 && WIFSIGNALED(status)) {
+        snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(status)));
+    } else if (exit_status(status) != 0) {
+        snprintf(state, sizeof(state), "Exit %d", exit_status(status));
+    } else {
+        snprintf(state, sizeof(state), "Done");
+    }
+    
+    const char *suffix = js == JOB_RUNNING && job->background ? " &" : "";
+    outbuf_printf(out, "[%d]%c  %-24s%s%s\n", job->id, marker, state, job->command, suffix);
+}
+
+// Function to handle SIGCHLD by waking up the main loop
+void sigchld_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    ssize_t unused = write(sigchld_pipe[1], "", 1);
+    (void)unused;
+    errno = saved_errno;
+}
+
+// Function to collect state changes of background and stopped jobs without
+// blocking. Does nothing unless SIGCHLD has arrived since the last call.
+void reap_jobs(void) {
+    char buf[64];
+    int signalled = 0;
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+        signalled = 1;
+    }
+    if (!signalled) return;
+    
+    // Only the job table's own processes are waited for here, so a
+    // foreground wait never has its child taken from it
+    for (int i = 0; i < num_jobs; i++) {
+        Job *job = job_table[i];
+        for (int j = 0; j < job->num_procs; j++) {
+            if (job->pids[j] <= 0 || job->states[j] == JOB_DONE) continue;
+            int status;
+            struct rusage usage;
+            if (wait4(job->pids[j], &status, WNOHANG | WUNTRACED | WCONTINUED, &usage) == job->pids[j]) {
+                job_record(job, j, status, &usage);
+            }
+        }
+    }
+}
+
+// Function to report jobs that finished or stopped since the last prompt,
+// dropping the finished ones from the job table
+void notify_jobs(void) {
+    OutBuf out = {0};
+    for (int i = 0; i < num_jobs; i++) {
+        Job *job = job_table[i];
+        if (job->notified) continue;
+        
+        JobState state = job_state(job);
+        if (state == JOB_RUNNING) continue;
+        print_job(job, &out);
+        job->notified = 1;
+        if (state == JOB_DONE) {
+            if (job->timed) print_job_times(job);
+            job_remove(job);
+            job_free(job);
+            i--;
+        }
+    }
+    outbuf_flush(&out, STDOUT_FILENO);
+    outbuf_free(&out);
+}
+
+// Function to wait until one of a job's processes exits (or stops, with job control)
+void wait_for_process(Job *job, int i) {
+    while (job->pids[i] > 0 && job->states[i] == JOB_RUNNING) {
+        int status;
+        struct rusage usage;
+        if (wait4(job->pids[i], &status, job_control ? WUNTRACED : 0, &usage) == -1) {
+            if (errno == EINTR) continue;
+            job->states[i] = JOB_DONE;  // Already reaped elsewhere
+            break;
+        }
+        job_record(job, i, status, &usage);
+    }
+}
+
+// Function to wait until every process of a job has exited or stopped
+void wait_for_job(Job *job) {
+    for (int i = 0; i < job->num_procs; i++) {
+        wait_for_process(job, i);
+    }
+    if (job_state(job) == JOB_DONE) {
+        job_finish_writers(job);
+    }
+}
+
+// Function to run a job in the foreground until it finishes or is stopped.
+// A finished job is freed; a stopped one goes into the job table. Returns the
+// job's exit status.
+int run_foreground_job(Job *job) {
+    if (job_control && job->pgid > 0) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    long long wait_start = trace_clock();
+    wait_for_job(job);
+    trace_event(TRACE_WAIT, wait_start, job->pgid, exit_status(job->statuses[job->num_procs - 1]),
+                job->command, strlen(job->command));
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+    
+    if (job_state(job) == JOB_STOPPED) {
+        if (job->id == 0) job_add(job);
+        job->background = 0;
+        OutBuf out = {0};
+        outbuf_puts(&out, "\n");
+        print_job(job, &out);
+        outbuf_flush(&out, STDOUT_FILENO);
+        outbuf_free(&out);
+        job->notified = 1;
+        int stopped = W_EXITCODE(128 + SIGTSTP, 0);
+        set_pipe_status(&stopped, 1);
+        return 128 + SIGTSTP;
+    }
+    
+    int status = exit_status(job->statuses[job->num_procs - 1]);
+    set_pipe_status(job->statuses, job->num_procs);
+    if (job->timed) print_job_times(job);
+    if (job->id != 0) job_remove(job);
+    job_free(job);
+    return status;
+}
+
+// Function to send SIGCONT to a stopped job
+void continue_job(Job *job) {
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->states[i] == JOB_STOPPED) job->states[i] = JOB_RUNNING;
+    }
+    if (job_control && job->pgid > 0) {
+        kill(-job->pgid, SIGCONT);
+        return;
+    }
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->pids[i] > 0 && job->states[i] == JOB_RUNNING) kill(job->pids[i], SIGCONT);
+    }
+}
+
+// Function to set up SIGCHLD handling and, for an interactive shell on a
+// terminal, job control
+void init_jobs(void) {
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("pipe failed");
+        exit(1);
+    }
+    
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    
+    if (!interactive) return;
+    
+    // Wait until we are in the foreground before taking over the terminal
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+        if (tcgetpgrp(STDIN_FILENO) == -1) return;  // No controlling terminal
+        kill(-shell_pgid, SIGTTIN);
+    }
+    
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    
+    // Lead our own process group (a session leader already does)
+    if (getpid() != getsid(0)) {
+        setpgid(0, 0);
+    }
+    shell_pgid = getpgrp();
+    job_control = tcsetpgrp(STDIN_FILENO, shell_pgid) == 0;
+}
+
+// Handle the 'jobs' builtin
+int handle_jobs(char **args, OutBuf *out) {
+    (void)args;
+    reap_jobs();
+    for (int i = 0; i < num_jobs; i++) {
+        Job *job = job_table[i];
+        print_job(job, out);
+        job->notified = 1;
+        if (job_state(job) == JOB_DONE) {
+            if (job->timed) print_job_times(job);
+            job_remove(job);
+            job_free(job);
+            i--;
+        }
+    }
+    return 0;
+}
+
+// Handle the 'wait' builtin: wait for every job, or for the given jobs or pids
+int handle_wait(char **args) {
+    if (args[1] == NULL) {
+        while (num_jobs > 0) {
+            Job *job = job_table[0];
+            wait_for_job(job);
+            if (job_state(job) != JOB_DONE) break;  // Stopped jobs can't finish
+            if (job->timed) print_job_times(job);
+            job_remove(job);
+            job_free(job);
+        }
+        return 0;
+    }
+    
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        Job *job = NULL;
+        int proc = -1;
+        if (args[i][0] == '%') {
+            job = job_find(args[i]);
+        } else {
+            pid_t pid = atoi(args[i]);
+            for (int j = 0; j < num_jobs && !job; j++) {
+                for (int k = 0; k < job_table[j]->num_procs; k++) {
+                    if (pid > 0 && job_table[j]->pids[k] == pid) {
+                        job = job_table[j];
+                        proc = k;
+                        break;
+                    }
+                }
+            }
+        }
+        
+        if (!job) {
+            if (args[i][0] == '%') {
+                fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            } else {
+                fprintf(stderr, "wait: pid %s is not a child of this shell\n", args[i]);
+            }
+            status = 127;
+            continue;
+        }
+        
+        if (proc >= 0) {
+            wait_for_process(job, proc);
+            status = exit_status(job->statuses[proc]);
+        } else {
+            wait_for_job(job);
+            status = exit_status(job->statuses[job->num_procs - 1]);
+        }
+        if (job_state(job) == JOB_DONE) {
+            if (job->timed) print_job_times(job);
+            job_remove(job);
+            job_free(job);
+        }
+    }
+    return status;
+}
+
+// Handle the 'fg' builtin
+int handle_fg(char **args, OutBuf *out) {
+    Job *job = job_find(args[1]);
+    if (!job) {
+        fprintf(stderr, "fg: %s: no such job\n", args[1] ? args[1] : "current");
+        return 1;
+    }
+    if (job_state(job) == JOB_DONE) {
+        fprintf(stderr, "fg: job has terminated\n");
+        job_remove(job);
+        job_free(job);
+        return 1;
+    }
+    
+    // The command line goes out before the job can write anything
+    outbuf_printf(out, "%s\n", job->command);
+    outbuf_flush(out, STDOUT_FILENO);
+    job->background = 0;
+    if (job_control && job->pgid > 0) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    continue_job(job);
+    return run_foreground_job(job);
+}
+
+// Handle the 'bg' builtin
+int handle_bg(char **args, OutBuf *out) {
+    Job *job = job_find(args[1]);
+    if (!job) {
+        fprintf(stderr, "bg: %s: no such job\n", args[1] ? args[1] : "current");
+        return 1;
+    }
+    if (job_state(job) != JOB_STOPPED) {
+        fprintf(stderr, "bg: job %d already in background\n", job->id);
+        return 0;
+    }
+    
+    job->background = 1;
+    continue_job(job);
+    outbuf_printf(out, "[%d]%c %s &\n", job->id, job == job_table[num_jobs - 1] ? '+' : ' ', job->command);
+    return 0;
+}
+
+// Handle the 'echo' builtin
+void handle_echo(char **args, OutBuf *out) {
+    // Size the whole line first so the buffer grows at most once
+    size_t total = 1;
+    for (int i = 1; args[i] != NULL; i++) {
+        total += strlen(args[i]) + 1;
+    }
+    outbuf_reserve(out, total);
+    
+    for (int i = 1; args[i] != NULL; i++) {
+        // Print space between arguments
+        if (i > 1) {
+            outbuf_append(out, " ", 1);
+        }
+        outbuf_puts(out, args[i]);
+    }
+    outbuf_append(out, "\n", 1);
+}
+
+void handle_pwd(OutBuf *out) {
+    char cwd[MAX_PATH_LENGTH];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        outbuf_printf(out, "%s\n", cwd);
+    } else {
+        perror("pwd");
+    }
+}
+
+// Handle the 'cd' builtin
+int handle_cd(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "cd: missing argument\n");
+        return 1;
+    }
+    
+    char *path = args[1];
+    char expanded_path[MAX_PATH_LENGTH];
+    
+    // Handle ~ character
+    if (*path == '~') {
+        const char *home = get_variable("HOME");
+        if (home == NULL) {
+            fprintf(stderr, "cd: HOME environment variable not set\n");
+            return 1;
+        }
+        
+        // If path is just ~, use home directory directly
+        if (*(path + 1) == '\0') {
+            strncpy(expanded_path, home, MAX_PATH_LENGTH - 1);
+            expanded_path[MAX_PATH_LENGTH - 1] = '\0';
+        } else {
+            // If path is ~/something, concatenate home and the rest of the path
+            snprintf(expanded_path, MAX_PATH_LENGTH, "%s%s", home, path + 1);
+        }
+        path = expanded_path;
+    }
+    
+    // Try to change directory
+    if (chdir(path) != 0) {
+        fprintf(stderr, "cd: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    
+    // Cached directories are relative to the old working directory
+    dir_cache_flush();
+    return 0;
+}
+
+// Function to parse a size such as 65536, 256K or 1M. Returns -1 if invalid.
+long parse_size(const char *str) {
+    char *end;
+    errno = 0;
+    long size = strtol(str, &end, 10);
+    if (end == str || errno != 0 || size < 0) {
+        return -1;
+    }
+    
+    long unit = 1;
+    if (*end == 'k' || *end == 'K') {
+        unit = 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        unit = 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' || size > INT32_MAX / unit) {
+        return -1;
+    }
+    return size * unit;
+}
+
+// Function to set the capacity of the shell's pipes, checking it against
+// a scratch pipe so a size the kernel won't allow is reported now
+int set_pipe_size(const char *value) {
+    if (strcmp(value, "default") == 0) {
+        pipe_size = 0;
+        return 0;
+    }
+    
+    long size = parse_size(value);
+    if (size <= 0) {
+        fprintf(stderr, "set: pipesize: %s: invalid size\n", value);
+        return 1;
+    }
+    
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe failed");
+        return 1;
+    }
+    int result = fcntl(fds[1], F_SETPIPE_SZ, (int)size);
+    int err = errno;
+    close(fds[0]);
+    close(fds[1]);
+    if (result == -1) {
+        fprintf(stderr, "set: pipesize: %s: %s\n", value, strerror(err));
+        return 1;
+    }
+    pipe_size = size;
+    return 0;
+}
+
+// Handle the 'set' builtin: set -o [name=value]
+int handle_set(char **args, OutBuf *out) {
+    if (args[1] == NULL || strcmp(args[1], "-o") != 0) {
+        fprintf(stderr, "set: usage: set -o [name=value]\n");
+        return 1;
+    }
+    
+    // Without an option name, list the current settings
+    if (args[2] == NULL) {
+        outbuf_printf(out, "spawn\t%s\n", spawn_backend == SPAWN_BACKEND_POSIX ? "posix_spawn" : "fork");
+        if (pipe_size > 0) {
+            outbuf_printf(out, "pipesize\t%ld\n", pipe_size);
+        } else {
+            outbuf_puts(out, "pipesize\tdefault\n");
+        }
+        return 0;
+    }
+    
+    int status = 0;
+    for (int i = 2; args[i] != NULL; i++) {
+        if (strcmp(args[i], "spawn=posix_spawn") == 0) {
+            spawn_backend = SPAWN_BACKEND_POSIX;
+        } else if (strcmp(args[i], "spawn=fork") == 0) {
+            spawn_backend = SPAWN_BACKEND_FORK;
+        } else if (strncmp(args[i], "pipesize=", 9) == 0) {
+            if (set_pipe_size(args[i] + 9) != 0) status = 1;
+        } else {
+            fprintf(stderr, "set: %s: invalid option name\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Function to list variables for export or local, sorted by name, in a form
+// that can be read back in
+void list_variables(const char *builtin, int exported, OutBuf *out) {
+    int count = 0;
+    for (int i = 0; i < VAR_BUCKETS; i++) {
+        for (Variable *var = variables[i]; var; var = var->next) {
+            if (var->exported == exported) count++;
+        }
+    }
+    
+    const char **names = arena_alloc(&line_arena, (count + 1) * sizeof(char*));
+    count = 0;
+    for (int i = 0; i < VAR_BUCKETS; i++) {
+        for (Variable *var = variables[i]; var; var = var->next) {
+            if (var->exported == exported) names[count++] = var->name;
+        }
+    }
+    qsort(names, count, sizeof(char*), compare_names);
+    
+    for (int i = 0; i < count; i++) {
+        Variable *var = find_variable(names[i]);
+        outbuf_printf(out, "%s %s", builtin, var->name);
+        if (var->value) {
+            outbuf_puts(out, "=\"");
+            for (const char *c = var->value; *c; c++) {
+                if (*c == '"' || *c == '\\' || *c == '$' || *c == '`') outbuf_append(out, "\\", 1);
+                outbuf_append(out, c, 1);
+            }
+            outbuf_puts(out, "\"");
+        }
+        outbuf_puts(out, "\n");
+    }
+}
+
+// Function to set the variables named by NAME or NAME=value arguments,
+// for export and local
+int declare_variables(char **args, int exported) {
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        char *equals = strchr(args[i], '=');
+        size_t len = equals ? (size_t)(equals - args[i]) : strlen(args[i]);
+        if (!is_valid_name(args[i], len)) {
+            fprintf(stderr, "%s: `%s': not a valid identifier\n", args[0], args[i]);
+            status = 1;
+            continue;
+        }
+        char *name = arena_strndup(&line_arena, args[i], len);
+        set_variable(name, equals ? equals + 1 : NULL, exported);
+    }
+    return status;
+}
+
+// Handle the 'export' builtin: export [NAME[=VALUE]...]
+int handle_export(char **args, OutBuf *out) {
+    if (args[1] == NULL) {
+        list_variables("export", 1, out);
+        return 0;
+    }
+    return declare_variables(args, 1);
+}
+
+// Handle the 'local' builtin: local [NAME[=VALUE]...]. The shell has no
+// functions to scope it to, so it declares shell variables kept out of the
+// environment.
+int handle_local(char **args, OutBuf *out) {
+    if (args[1] == NULL) {
+        list_variables("local", 0, out);
+        return 0;
+    }
+    return declare_variables(args, 0);
+}
+
+// Handle the 'unset' builtin
+int handle_unset(char **args) {
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (!is_valid_name(args[i], strlen(args[i]))) {
+            fprintf(stderr, "unset: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+            continue;
+        }
+        unset_variable(args[i]);
+    }
+    return status;
+}
+
+// Function to check for a builtin that only writes output and leaves the
+// shell unchanged, so a pipeline can run it without a child process
+int is_output_builtin(const char *name) {
+    return strcmp(name, "echo") == 0 || strcmp(name, "type") == 0 || strcmp(name, "pwd") == 0 ||
+           strcmp(name, "history") == 0;
+}
+
+// Function to run a builtin from is_output_builtin, writing to out
+int run_output_builtin(char **args, OutBuf *out) {
+    const char *cmd = args[0];
+    int status = 0;
+    
+    if (strcmp(cmd, "echo") == 0) {
+        handle_echo(args, out);
+    } else if (strcmp(cmd, "type") == 0) {
+        for (int i = 1; args[i] != NULL; i++) {
+            print_type(args[i], out);
+        }
+    } else if (strcmp(cmd, "pwd") == 0) {
+        handle_pwd(out);
+    } else if (strcmp(cmd, "history") == 0) {
+        status = handle_history(args, out);
+    }
+    return status;
+}
+
+// Function to run a builtin command in the shell process. Its output is
+// collected and written with a single syscall when it returns, which is
+// always before the shell next forks or exits.
+int run_builtin(char **args) {
+    const char *cmd = args[0];
+    int status = 0;
+    OutBuf out = {0};
+    
+    if (is_output_builtin(cmd)) {
+        status = run_output_builtin(args, &out);
+    } else if (strcmp(cmd, "hash") == 0) {
+        status = handle_hash(args, &out);
+    } else if (strcmp(cmd, "set") == 0) {
+        status = handle_set(args, &out);
+    } else if (strcmp(cmd, "batch") == 0) {
+        status = handle_batch(args);
+    } else if (strcmp(cmd, "export") == 0) {
+        status = handle_export(args, &out);
+    } else if (strcmp(cmd, "local") == 0) {
+        status = handle_local(args, &out);
+    } else if (strcmp(cmd, "unset") == 0) {
+        status = handle_unset(args);
+    } else if (strcmp(cmd, "cd") == 0) {
+        status = handle_cd(args);
+    } else if (strcmp(cmd, "jobs") == 0) {
+        status = handle_jobs(args, &out);
+    } else if (strcmp(cmd, "wait") == 0) {
+        status = handle_wait(args);
+    } else if (strcmp(cmd, "fg") == 0) {
+        status = handle_fg(args, &out);
+    } else if (strcmp(cmd, "bg") == 0) {
+        status = handle_bg(args, &out);
+    } else if (strcmp(cmd, "exit") == 0) {
+        exit(args[1] ? atoi(args[1]) : last_status);
+    }
+    
+    if (outbuf_flush(&out, STDOUT_FILENO) != 0) {
+        fprintf(stderr, "%s: write error: %s\n", cmd, strerror(errno));
+        status = 1;
+    }
+    outbuf_free(&out);
+    return status;
+}
+
+// Function to get the open() flags for a file redirection
+int redirection_flags(Redirection *redir) {
+    if (redir->type == REDIR_INPUT) {
+        return O_RDONLY;
+    } else if (redir->type == REDIR_READWRITE) {
+        return O_RDWR | O_CREAT;
+    }
+    return O_WRONLY | O_CREAT | (redir->type == REDIR_APPEND ? O_APPEND : O_TRUNC);
+}
+
+// Function to move a descriptor the shell opened for a redirection to 10 or
+// above, out of the range redirections usually name, so later steps can't
+// clobber it. Keeps close-on-exec set.
+int move_fd_high(int fd) {
+    if (fd < 10) {
+        int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        if (high != -1) {
+            close(fd);
+            fd = high;
+        }
+    }
+    return fd;
+}
+
+// Function to get a descriptor to read a here-document's body from. A body
+// that fits in a pipe without blocking goes into a pipe; a larger one goes
+// into a memfd, so neither touches the filesystem.
+int open_heredoc(HereDoc *heredoc) {
+    if (heredoc->len <= PIPE_BUF) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe failed");
+            return -1;
+        }
+        if (heredoc->len > 0 && write(fds[1], heredoc->body, heredoc->len) != (ssize_t)heredoc->len) {
+            perror("write failed");
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        close(fds[1]);
+        return move_fd_high(fds[0]);
+    }
+    
+    int fd = memfd_create("heredoc", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create failed");
+        return -1;
+    }
+    size_t written = 0;
+    while (written < heredoc->len) {
+        ssize_t n = write(fd, heredoc->body + written, heredoc->len - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write failed");
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return move_fd_high(fd);
+}
+
+// Function to open the target of a file or here-document redirection,
+// close-on-exec and moved out of the way by move_fd_high. Returns -1 (after
+// printing an error) if it can't be opened.
+int open_redirection(Redirection *redir) {
+    if (redir->type == REDIR_HEREDOC) {
+        return open_heredoc(redir->heredoc);
+    }
+    
+    if (redir->type != REDIR_INPUT) {
+        create_parent_directories(redir->filename);
+    }
+    int fd = open(redir->filename, redirection_flags(redir) | O_CLOEXEC, 0666);
+    if (fd == -1 && errno == ENOENT && redir->type != REDIR_INPUT && strchr(redir->filename, '/')) {
+        // A cached directory was removed behind our back: forget them all and retry
+        dir_cache_flush();
+        create_parent_directories(redir->filename);
+        fd = open(redir->filename, redirection_flags(redir) | O_CLOEXEC, 0666);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "open failed for %s: %s\n", redir->filename, strerror(errno));
+        return -1;
+    }
+    return move_fd_high(fd);
+}
+
+// Function to apply a command's redirections to the shell itself, in order.
+// When saved is not NULL, the replaced descriptors are kept there so that
+// restore_redirections can put them back. Returns -1 if one can't be applied.
+int apply_redirections(SimpleCommand *cmd, int *saved) {
+    // Mark every entry as not yet applied
+    for (int i = 0; saved && i < cmd->num_redirs; i++) {
+        saved[i] = -2;
+    }
+    
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        Redirection *redir = &cmd->redirs[i];
+        
+        int fd = -1;
+        if (redir->type == REDIR_DUP) {
+            if (fcntl(redir->src_fd, F_GETFD) == -1) {
+                fprintf(stderr, "%d: %s\n", redir->src_fd, strerror(EBADF));
+                return -1;
+            }
+        } else if (redir->type != REDIR_CLOSE) {
+            fd = open_redirection(redir);
+            if (fd == -1) {
+                return -1;
+            }
+        }
+        
+        // Keep the original out of the way of later redirections
+        if (saved) {
+            saved[i] = fcntl(redir->fd, F_DUPFD_CLOEXEC, 10);
+        }
+        
+        if (redir->type == REDIR_CLOSE) {
+            close(redir->fd);
+            continue;
+        }
+        
+        int src_fd = redir->type == REDIR_DUP ? redir->src_fd : fd;
+        if (src_fd != redir->fd && dup2(src_fd, redir->fd) == -1) {
+            fprintf(stderr, "dup2 failed: %s\n", strerror(errno));
+            if (fd != -1) close(fd);
+            return -1;
+        }
+        if (fd != -1) close(fd);
+    }
+    return 0;
+}
+
+// Function to undo apply_redirections, most recent first
+void restore_redirections(SimpleCommand *cmd, int *saved) {
+    for (int i = cmd->num_redirs - 1; i >= 0; i--) {
+        if (saved[i] == -2) continue;  // Never applied
+        if (saved[i] == -1) {
+            close(cmd->redirs[i].fd);  // Descriptor wasn't open before
+        } else {
+            dup2(saved[i], cmd->redirs[i].fd);
+            close(saved[i]);
+        }
+    }
+}
+
+// Function to run a builtin with its redirections applied around it
+int run_builtin_redirected(SimpleCommand *cmd) {
+    int *saved = arena_alloc(&line_arena, (cmd->num_redirs + 1) * sizeof(int));
+    
+    int status = 1;
+    if (apply_redirections(cmd, saved) == 0) {
+        status = run_builtin(cmd->args);
+    }
+    restore_redirections(cmd, saved);
+    return status;
+}
+
+// Function to add a command's redirections to the descriptor setup of its
+// child. Files are opened here in the shell, and each one is recorded in
+// opened so it can be closed once the child has started. Returns the new
+// number of actions, or -1 if a file can't be opened.
+int add_redirection_actions(SimpleCommand *cmd, SpawnAction *actions, int num_actions, int *opened, int *num_opened) {
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        Redirection *redir = &cmd->redirs[i];
+        if (redir->type == REDIR_CLOSE) {
+            actions[num_actions++] = (SpawnAction){ .type = SPAWN_CLOSE, .fd = redir->fd };
+        } else if (redir->type == REDIR_DUP) {
+            actions[num_actions++] = (SpawnAction){ .type = SPAWN_DUP2, .fd = redir->fd, .src_fd = redir->src_fd };
+        } else {
+            int fd = open_redirection(redir);
+            if (fd == -1) {
+                return -1;
+            }
+            opened[(*num_opened)++] = fd;
+            actions[num_actions++] = (SpawnAction){ .type = SPAWN_DUP2, .fd = redir->fd, .src_fd = fd };
+        }
+    }
+    return num_actions;
+}
+
+// Function to write the rest of a builtin's output into its pipe. Runs on a
+// thread with every signal blocked, so a closed reader just gives EPIPE, and
+// the SIGPIPE pending on the thread goes away with it. The job joins it.
+void* pipe_writer_thread(void *arg) {
+    PipeWriter *writer = arg;
+    while (writer->written < writer->len) {
+        ssize_t n = write(writer->fd, writer->data + writer->written, writer->len - writer->written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            writer->broken = 1;  // EPIPE: nobody is reading any more
+            break;
+        }
+        writer->written += n;
+    }
+    close(writer->fd);
+    free(writer->data);
+    writer->data = NULL;
+    return NULL;
+}
+
+// Function to write an in-shell pipeline stage's output into the pipe to the
+// next stage. What fits in the pipe is written right away; the rest is left
+// to a helper thread, returned in *writer, so the shell never blocks on a
+// reader that hasn't been started yet. The shell holds the read end until
+// the whole pipeline is launched, so only the thread can see the reader
+// quit. Takes ownership of data. Returns -1 if the thread can't be started.
+int write_stage_output(int fd, char *data, size_t len, PipeWriter **writer) {
+    *writer = NULL;
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;  // EAGAIN: the pipe is full
+        }
+        written += n;
+    }
+    fcntl(fd, F_SETFL, flags);
+    
+    if (written == len) {
+        free(data);
+        return 0;
+    }
+    
+    // A thread with its own descriptor finishes the job
+    PipeWriter *rest = calloc(1, sizeof(PipeWriter));
+    int writer_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (rest && writer_fd != -1) {
+        rest->fd = writer_fd;
+        rest->data = data;
+        rest->len = len;
+        rest->written = written;
+        
+        sigset_t all, saved;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &saved);
+        int err = pthread_create(&rest->thread, NULL, pipe_writer_thread, rest);
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        
+        if (err == 0) {
+            *writer = rest;
+            return 0;
+        }
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+    } else {
+        perror("pipe writer setup failed");
+    }
+    if (writer_fd != -1) close(writer_fd);
+    free(rest);
+    free(data);
+    return -1;
+}
+
+// Function to run an output-only builtin as a pipeline stage inside the shell,
+// sending its output to out_fd. Returns the stage's wait status; a thread
+// still writing its output is returned in *writer.
+int run_stage_in_shell(SimpleCommand *cmd, int out_fd, PipeWriter **writer) {
+    OutBuf out = {0};
+    SavedVariable *saved = arena_alloc(&line_arena, (cmd->num_assigns + 1) * sizeof(SavedVariable));
+    apply_assignments(cmd, saved, 1);
+    int status = run_output_builtin(cmd->args, &out);
+    restore_assignments(cmd, saved);
+    
+    // The last stage writes straight to the shell's stdout
+    *writer = NULL;
+    if (out_fd == STDOUT_FILENO) {
+        outbuf_flush(&out, STDOUT_FILENO);
+        outbuf_free(&out);
+        return W_EXITCODE(status, 0);
+    }
+    
+    // A reader that quits early kills a forked echo with SIGPIPE; the job
+    // reports the same when it joins the writer (job_finish_writers)
+    if (write_stage_output(out_fd, out.data, out.len, writer) != 0) {
+        return W_EXITCODE(1, 0);
+    }
+    return W_EXITCODE(status, 0);
+}
+
+// Function to report a command that isn't a builtin or in PATH, or a path
+// to a file that can't be run. The message honours the command's
+// redirections (e.g. 2>). Returns the exit status: 126 for a file that
+// exists but isn't executable, else 127.
+int report_not_found(SimpleCommand *cmd) {
+    const char *name = cmd->args[0];
+    char reason[128];
+    int status = 127;
+    snprintf(reason, sizeof(reason), "command not found");
+    
+    struct stat st;
+    if (strchr(name, '/') && stat(name, &st) == -1) {
+        snprintf(reason, sizeof(reason), "%s", strerror(errno));
+    } else if (strchr(name, '/')) {
+        snprintf(reason, sizeof(reason), "%s", S_ISDIR(st.st_mode) ? strerror(EISDIR) : strerror(EACCES));
+        status = 126;
+    }
+    
+    int *saved = arena_alloc(&line_arena, (cmd->num_redirs + 1) * sizeof(int));
+    if (apply_redirections(cmd, saved) == 0) {
+        fprintf(stderr, "%s: %s\n", name, reason);
+    }
+    restore_redirections(cmd, saved);
+    return status;
+}
+
+// Function to free the paths resolved for a pipeline's stages
+void free_exec_paths(char **exec_paths, int count) {
+    for (int i = 0; i < count; i++) {
+        free(exec_paths[i]);
+    }
+}
+
+// Function to turn a forked child into a subshell that runs its own commands:
+// no job control, default signals, and none of the parent's jobs
+void enter_subshell(void) {
+    reset_child_signals();
+    interactive = 0;
+    job_control = 0;
+    num_jobs = 0;
+    
+    // Events from here on are this process's to flush; the parent has the rest
+    trace_pid = getpid();
+    trace_flushed = trace_head;
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    sigchld_pipe[0] = sigchld_pipe[1] = -1;
+}
+
+// Function to expand one word kept as raw text, running its substitutions.
+// With fields the result is split and added there as arguments; either way
+// the unsplit text is returned.
+char* expand_word(const char *raw, SimpleCommand *fields) {
+    Lexer lexer;
+    memset(&lexer, 0, sizeof(lexer));
+    lexer.pos = raw;
+    lexer.end = raw + strlen(raw);
+    lexer.word_capacity = lexer.end - lexer.pos + 1;
+    lexer.word = arena_alloc(&line_arena, lexer.word_capacity);
+    lexer.expand = 1;
+    lexer.fields = fields;
+    
+    // The word was checked when the line was parsed
+    Token token;
+    if (lex_word(&lexer, &token) != 0) {
+        return arena_strdup(&line_arena, "");
+    }
+    if (fields && (lexer.word_len > 0 || lexer.field_started)) {
+        add_argument(fields, lexer.word, lexer.word_len);
+    }
+    return lexer.word;
+}
+
+// Function to run the substitutions in a here-document's body, or in a
+// here-string's word
+void expand_heredoc(HereDoc *heredoc) {
+    if (!heredoc->delimiter) {
+        // The body is the word's source text plus a newline
+        heredoc->body[heredoc->len - 1] = '\0';
+        char *word = expand_word(heredoc->body, NULL);
+        heredoc->len = strlen(word) + 1;
+        heredoc->body = arena_alloc(&line_arena, heredoc->len + 1);
+        memcpy(heredoc->body, word, heredoc->len - 1);
+        heredoc->body[heredoc->len - 1] = '\n';
+        heredoc->body[heredoc->len] = '\0';
+        heredoc->expand = 0;
+        return;
+    }
+    
+    // In a body, backslash only escapes $, `, itself and newline
+    Lexer lexer;
+    memset(&lexer, 0, sizeof(lexer));
+    lexer.pos = heredoc->body;
+    lexer.end = heredoc->body + heredoc->len;
+    lexer.word_capacity = heredoc->len + 1;
+    lexer.word = arena_alloc(&line_arena, lexer.word_capacity);
+    lexer.expand = 1;
+    while (lexer.pos < lexer.end) {
+        const char *special = scan_special(lexer.pos, lexer.end, &heredoc_scan_set);
+        lexer_append(&lexer, lexer.pos, special - lexer.pos);
+        lexer.pos = special;
+        if (lexer.pos >= lexer.end) break;
+        
+        if (*lexer.pos == '\\') {
+            char next = lexer.pos + 1 < lexer.end ? lexer.pos[1] : '\0';
+            if (next == '$' || next == '`' || next == '\\') {
+                lexer_append(&lexer, &next, 1);
+                lexer.pos += 2;
+            } else if (next == '\n') {
+                lexer.pos += 2;
+            } else {
+                lexer_append(&lexer, "\\", 1);
+                lexer.pos++;
+            }
+        } else if (lex_substitution(&lexer, 1) != 0) {
+            break;
+        }
+    }
+    heredoc->body = lexer.word;
+    heredoc->len = lexer.word_len;
+    heredoc->expand = 0;
+}
+
+// Function to expand a command's words, assignments, file names and
+// here-documents now that it is about to run, so substitutions see the
+// effects of the commands before it
+void expand_command(SimpleCommand *cmd) {
+    if (cmd->expanded) {
+        return;
+    }
+    cmd->expanded = 1;
+    
+    for (int i = 0; i < cmd->num_assigns; i++) {
+        cmd->assigns[i] = expand_word(cmd->assigns[i], NULL);
+    }
+    
+    if (cmd->num_expansions > 0) {
+        SimpleCommand expanded;
+        memset(&expanded, 0, sizeof(expanded));
+        expanded.arg_capacity = cmd->arg_count + 8;
+        expanded.args = arena_alloc(&line_arena, expanded.arg_capacity * sizeof(char*));
+        expanded.args[0] = NULL;
+        
+        // A word may become several arguments, or none, so process
+        // substitutions are moved along with theirs
+        int next = 0;
+        int next_subst = 0;
+        for (int i = 0; i < cmd->arg_count; i++) {
+            if (next_subst < cmd->num_substs && cmd->substs[next_subst].arg_index == i) {
+                cmd->substs[next_subst++].arg_index = expanded.arg_count;
+            }
+            if (next < cmd->num_expansions && cmd->expansions[next] == i) {
+                expand_word(cmd->args[i], &expanded);
+                next++;
+            } else {
+                add_argument(&expanded, cmd->args[i], strlen(cmd->args[i]));
+            }
+        }
+        cmd->args = expanded.args;
+        cmd->arg_count = expanded.arg_count;
+        cmd->arg_capacity = expanded.arg_capacity;
+        cmd->num_expansions = 0;
+    }
+    
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        if (cmd->redirs[i].expand) {
+            cmd->redirs[i].filename = expand_word(cmd->redirs[i].filename, NULL);
+            cmd->redirs[i].expand = 0;
+        } else if (cmd->redirs[i].type == REDIR_HEREDOC && cmd->redirs[i].heredoc->expand) {
+            expand_heredoc(cmd->redirs[i].heredoc);
+        }
+    }
+}
+
+// Function to run a command line for $(...) with its output added to out.
+// A lone echo, type or pwd runs in the shell; anything else runs in a forked
+// subshell writing into a pipe. Sets last_status.
+void capture_command(char *command, OutBuf *out) {
+    CommandList *list = parse_command_list(command);
+    if (!list) {
+        last_status = 2;
+        return;
+    }
+    
+    if (list->count == 1) {
+        Pipeline *pipeline = list->pipelines[0];
+        SimpleCommand *cmd = &pipeline->commands[0];
+        int literal_name = cmd->num_expansions == 0 || cmd->expansions[0] != 0;
+        if (pipeline->num_commands == 1 && !pipeline->background && cmd->num_redirs == 0 &&
+            cmd->num_substs == 0 && cmd->arg_count > 0 && literal_name &&
+            is_output_builtin(cmd->args[0])) {
+            expand_command(cmd);
+            last_status = run_output_builtin(cmd->args, out);
+            return;
+        }
+    }
+    
+    int fd[2];
+    if (make_pipe(fd) == -1) {
+        perror("pipe failed");
+        last_status = 1;
+        return;
+    }
+    
+    // Ctrl-C stops the substitution, not the shell waiting on it
+    struct sigaction ignore, saved_int, saved_quit;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGINT, &ignore, &saved_int);
+    sigaction(SIGQUIT, &ignore, &saved_quit);
+    
+    long long fork_start = trace_clock();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child process
+        sigaction(SIGINT, &saved_int, NULL);
+        sigaction(SIGQUIT, &saved_quit, NULL);
+        enter_subshell();
+        if (dup2(fd[1], STDOUT_FILENO) == -1) {
+            perror("dup2 failed");
+            exit(1);
+        }
+        close(fd[0]);
+        close(fd[1]);
+        execute_command(command);
+        exit(last_status);
+    }
+    close(fd[1]);
+    if (pid > 0) trace_event(TRACE_FORK, fork_start, pid, 0, command, strlen(command));
+    
+    if (pid < 0) {
+        perror("fork failed");
+        last_status = 1;
+    } else {
+        // Read straight into the buffer until the subshell closes its end
+        while (1) {
+            outbuf_reserve(out, 4096);
+            ssize_t n = read(fd[0], out->data + out->len, out->capacity - out->len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            out->len += n;
+        }
+        
+        int status;
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        }
+        trace_event(TRACE_REAP, 0, pid, exit_status(status), command, strlen(command));
+        last_status = exit_status(status);
+    }
+    close(fd[0]);
+    sigaction(SIGINT, &saved_int, NULL);
+    sigaction(SIGQUIT, &saved_quit, NULL);
+}
+
+// Function to start a command's process substitutions, each running its
+// command line in a forked subshell on one end of a pipe. The other end is
+// left in fds for the command to inherit, and its argument becomes
+// /dev/fd/N. The pipeline's own pipes are passed so the subshells can close
+// them. Returns -1 if one could not be started.
+int start_substitutions(SimpleCommand *cmd, Job *job, int take_terminal,
+                        int (*pipefd)[2], int num_pipes, int *fds) {
+    for (int i = 0; i < cmd->num_substs; i++) {
+        fds[i] = -1;
+    }
+    
+    for (int i = 0; i < cmd->num_substs; i++) {
+        ProcSubst *subst = &cmd->substs[i];
+        int fd[2];
+        if (make_pipe(fd) == -1) {
+            perror("pipe failed");
+            return -1;
+        }
+        
+        // Keep the command's end clear of the low descriptors it may redirect
+        int inner_fd = subst->output ? fd[0] : fd[1];
+        fds[i] = move_fd_high(subst->output ? fd[1] : fd[0]);
+        
+        job->subst_pids = realloc(job->subst_pids, (job->num_substs + 1) * sizeof(pid_t));
+        if (!job->subst_pids) {
+            perror("malloc failed");
+            exit(1);
+        }
+        
+        long long fork_start = trace_clock();
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork failed");
+            close(inner_fd);
+            return -1;
+        }
+        
+        if (pid == 0) {
+            // Child process
+            if (job_control) setpgid(0, job->pgid);
+            if (take_terminal && job->pgid == 0) {
+                tcsetpgrp(STDIN_FILENO, getpgrp());
+            }
+            enter_subshell();
+            
+            // Hold no other pipe open, or its reader would never see end of file
+            for (int j = 0; j <= i; j++) {
+                close(fds[j]);
+            }
+            for (int j = 0; j < num_pipes; j++) {
+                close(pipefd[j][0]);
+                close(pipefd[j][1]);
+            }
+            
+            if (dup2(inner_fd, subst->output ? STDIN_FILENO : STDOUT_FILENO) == -1) {
+                perror("dup2 failed");
+                exit(1);
+            }
+            close(inner_fd);
+            execute_command(subst->command);
+            exit(last_status);
+        }
+        
+        if (job_control) {
+            setpgid(pid, job->pgid ? job->pgid : pid);
+            if (job->pgid == 0) job->pgid = pid;
+        }
+        close(inner_fd);
+        job->subst_pids[job->num_substs++] = pid;
+        trace_event(TRACE_FORK, fork_start, pid, 0, subst->command, strlen(subst->command));
+        
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/fd/%d", fds[i]);
+        cmd->args[subst->arg_index] = arena_strdup(&line_arena, path);
+    }
+    return 0;
+}
+
+// Function to close the descriptors left for a command by start_substitutions
+void close_substitution_fds(int *fds, int count) {
+    for (int i = 0; i < count; i++) {
+        if (fds[i] != -1) close(fds[i]);
+    }
+}
+
+// Function to start every stage of a pipeline as one job, each stage's
+// process recorded in job->pids. Returns 0 once the job is started, or the
+// exit status if nothing could be started (127 for a missing command, 126
+// for a path to a file that can't be run).
+int launch_pipeline(Pipeline *pipeline, Job *job) {
+    // Resolve every external stage up front, through the command hash table,
+    // so a missing command fails the pipeline before any pipe or process exists
+    char **exec_paths = arena_alloc(&line_arena, pipeline->num_commands * sizeof(char*));
+    int missing = 0;  // Status of the last stage that can't be run
+    for (int i = 0; i < pipeline->num_commands; i++) {
+        SimpleCommand *cmd = &pipeline->commands[i];
+        exec_paths[i] = NULL;
+        if (cmd->arg_count == 0 || is_builtin(cmd->args[0])) {
+            continue;
+        }
+        
+        // A PATH=... prefix applies to the lookup too
+        SavedVariable *saved = arena_alloc(&line_arena, (cmd->num_assigns + 1) * sizeof(SavedVariable));
+        apply_assignments(cmd, saved, -1);
+        long long lookup_start = trace_clock();
+        exec_paths[i] = find_executable(cmd->args[0]);
+        trace_event(TRACE_LOOKUP, lookup_start, 0, exec_paths[i] ? 0 : 127, cmd->args[0], strlen(cmd->args[0]));
+        restore_assignments(cmd, saved);
+        if (!exec_paths[i]) {
+            missing = report_not_found(cmd);
+        }
+    }
+    if (missing) {
+        free_exec_paths(exec_paths, pipeline->num_commands);
+        return missing;
+    }
+    
+    // Create array of pipes
+    int (*pipefd)[2] = arena_alloc(&line_arena, pipeline->num_commands * sizeof(int[2]));
+    
+    // Create all pipes
+    for (int i = 0; i < pipeline->num_commands - 1; i++) {
+        if (make_pipe(pipefd[i]) == -1) {
+            perror("pipe failed");
+            // Close any pipes we've already created
+            for (int j = 0; j < i; j++) {
+                close(pipefd[j][0]);
+                close(pipefd[j][1]);
+            }
+            free_exec_paths(exec_paths, pipeline->num_commands);
+            return 1;
+        }
+    }
+    
+    // Without job control a background job must not read the terminal
+    int null_stdin = pipeline->background && !job_control;
+    
+    // A foreground job's first process takes the terminal before it runs, so
+    // it can't read it too early and be stopped
+    int take_terminal = job_control && !pipeline->background;
+    
+    // Create a process for each command
+    for (int i = 0; i < pipeline->num_commands; i++) {
+        SimpleCommand *cmd = &pipeline->commands[i];
+        job->pids[i] = 0;
+        job->states[i] = JOB_DONE;
+        job->statuses[i] = 0;
+        if (cmd->arg_count == 0) {
+            // Redirections only: create the files, run nothing
+            int *saved = arena_alloc(&line_arena, (cmd->num_redirs + 1) * sizeof(int));
+            if (apply_redirections(cmd, saved) != 0) {
+                job->statuses[i] = W_EXITCODE(1, 0);
+            }
+            restore_redirections(cmd, saved);
+            continue;
+        }
+        
+        // Process substitutions start first, so their descriptors exist
+        int *subst_fds = arena_alloc(&line_arena, (cmd->num_substs + 1) * sizeof(int));
+        if (start_substitutions(cmd, job, take_terminal, pipefd,
+                                pipeline->num_commands - 1, subst_fds) != 0) {
+            close_substitution_fds(subst_fds, cmd->num_substs);
+            job->statuses[i] = W_EXITCODE(1, 0);
+            continue;
+        }
+        
+        pid_t pgid = job_control ? job->pgid : -1;
+        pid_t pid = -1;
+        int failed_status = 126;  // Status if the stage can't be started
+        
+        if (exec_paths[i]) {
+            // External commands are spawned with their pipe ends as stdin/stdout;
+            // every pipe is close-on-exec so the child keeps only those
+            SpawnAction *actions = arena_alloc(&line_arena, (cmd->num_redirs + cmd->num_substs + 3) * sizeof(SpawnAction));
+            int num_actions = 0;
+            if (take_terminal && job->pgid == 0) {
+                actions[num_actions++] = (SpawnAction){ .type = SPAWN_TCSETPGRP, .fd = STDIN_FILENO };
+            }
+            if (i > 0) {
+                actions[num_actions++] = (SpawnAction){ .type = SPAWN_DUP2, .fd = STDIN_FILENO, .src_fd = pipefd[i-1][0] };
+            } else if (null_stdin) {
+                actions[num_actions++] = (SpawnAction){ .type = SPAWN_OPEN, .fd = STDIN_FILENO, .path = "/dev/null", .flags = O_RDONLY };
+            }
+            if (i < pipeline->num_commands - 1) {
+                actions[num_actions++] = (SpawnAction){ .type = SPAWN_DUP2, .fd = STDOUT_FILENO, .src_fd = pipefd[i][1] };
+            }
+            
+            // Substituted descriptors are inherited through a dup2 onto themselves,
+            // which clears close-on-exec in this child only
+            for (int j = 0; j < cmd->num_substs; j++) {
+                actions[num_actions++] = (SpawnAction){ .type = SPAWN_DUP2, .fd = subst_fds[j], .src_fd = subst_fds[j] };
+            }
+            int *opened = arena_alloc(&line_arena, (cmd->num_redirs + 1) * sizeof(int));
+            int num_opened = 0;
+            num_actions = add_redirection_actions(cmd, actions, num_actions, opened, &num_opened);
+            
+            if (num_actions >= 0) {
+                pid = spawn_command(exec_paths[i], cmd->args, command_environment(cmd), actions, num_actions, pgid);
+            } else {
+                failed_status = 1;
+            }
+            for (int j = 0; j < num_opened; j++) {
+                close(opened[j]);
+            }
+        } else if (is_output_builtin(cmd->args[0]) && cmd->num_redirs == 0 && !pipeline->background) {
+            // Output-only builtins run in the shell and feed the pipe directly
+            int out_fd = i < pipeline->num_commands - 1 ? pipefd[i][1] : STDOUT_FILENO;
+            struct rusage before, after;
+            getrusage(RUSAGE_THREAD, &before);
+            job->statuses[i] = run_stage_in_shell(cmd, out_fd, &job->writers[i]);
+            getrusage(RUSAGE_THREAD, &after);
+            rusage_delta(&job->usage[i], &before, &after);
+            job->ended_ns[i] = monotonic_ns();
+            close_substitution_fds(subst_fds, cmd->num_substs);
+            continue;
+        } else {
+            // Other builtins run in a forked copy of the shell
+            long long fork_start = trace_clock();
+            pid = fork();
+            if (pid < 0) {
+                perror("fork failed");
+            } else if (pid == 0) {
+                // Child process
+                if (pgid >= 0) setpgid(0, pgid);
+                if (take_terminal && job->pgid == 0) {
+                    tcsetpgrp(STDIN_FILENO, getpgrp());
+                }
+                reset_child_signals();
+                
+                // Close all pipe ends we don't need
+                for (int j = 0; j < pipeline->num_commands - 1; j++) {
+                    if (j != i - 1) close(pipefd[j][0]);
+                    if (j != i) close(pipefd[j][1]);
+                }
+                
+                // Set up input redirection
+                if (i > 0) {
+                    if (dup2(pipefd[i-1][0], STDIN_FILENO) == -1) {
+                        perror("dup2 failed");
+                        exit(1);
+                    }
+                    close(pipefd[i-1][0]);
+                } else if (null_stdin) {
+                    int fd = open("/dev/null", O_RDONLY);
+                    if (fd != -1 && fd != STDIN_FILENO) {
+                        dup2(fd, STDIN_FILENO);
+                        close(fd);
+                    }
+                }
+                
+                // Set up output redirection
+                if (i < pipeline->num_commands - 1) {
+                    if (dup2(pipefd[i][1], STDOUT_FILENO) == -1) {
+                        perror("dup2 failed");
+                        exit(1);
+                    }
+                    close(pipefd[i][1]);
+                }
+                
+                // The stage's own redirections apply on top of the pipe
+                if (apply_redirections(cmd, NULL) != 0) {
+                    exit(1);
+                }
+                apply_assignments(cmd, NULL, 1);
+                exit(run_builtin(cmd->args));
+            } else {
+                if (pgid >= 0) setpgid(pid, pgid ? pgid : pid);
+                trace_event(TRACE_FORK, fork_start, pid, 0, cmd->args[0], strlen(cmd->args[0]));
+            }
+        }
+        close_substitution_fds(subst_fds, cmd->num_substs);
+        
+        if (pid < 0) {
+            job->statuses[i] = W_EXITCODE(failed_status, 0);
+            continue;
+        }
+        job->pids[i] = pid;
+        job->states[i] = JOB_RUNNING;
+        if (job->pgid == 0) job->pgid = pid;  // The first process leads the group
+    }
+    
+    // Parent process
+    // Close all pipe ends
+    for (int i = 0; i < pipeline->num_commands - 1; i++) {
+        close(pipefd[i][0]);
+        close(pipefd[i][1]);
+    }
+    free_exec_paths(exec_paths, pipeline->num_commands);
+    return 0;
+}
+
+// Function to execute a single command in the shell itself: a builtin, or a
+// command made of redirections only. Returns its exit status.
+int execute_simple_command(SimpleCommand *cmd) {
+    // Assignments alone set shell variables; redirections alone just create
+    // (or truncate) their files
+    if (cmd->arg_count == 0) {
+        apply_assignments(cmd, NULL, -1);
+        int *saved = arena_alloc(&line_arena, (cmd->num_redirs + 1) * sizeof(int));
+        int status = apply_redirections(cmd, saved) == 0 ? 0 : 1;
+        restore_redirections(cmd, saved);
+        return status;
+    }
+    
+    // Builtins run in the shell with their redirections and any NAME=value
+    // prefixes applied around them
+    SavedVariable *saved = arena_alloc(&line_arena, (cmd->num_assigns + 1) * sizeof(SavedVariable));
+    apply_assignments(cmd, saved, 1);
+    int status = run_builtin_redirected(cmd);
+    restore_assignments(cmd, saved);
+    return status;
+}
+
+// Function to run a pipeline, in the foreground or as a background job.
+// Returns its exit status.
+int run_pipeline(Pipeline *pipeline) {
+    for (int i = 0; i < pipeline->num_commands; i++) {
+        expand_command(&pipeline->commands[i]);
+    }
+    
+    // A lone builtin or bare redirection in the foreground runs in the shell,
+    // unless process substitutions need a job to own them
+    SimpleCommand *first = &pipeline->commands[0];
+    if (!pipeline->background && pipeline->num_commands == 1 && first->num_substs == 0 &&
+        (first->arg_count == 0 || is_builtin(first->args[0]))) {
+        long long started_ns = monotonic_ns();
+        struct rusage before, after, usage;
+        getrusage(RUSAGE_SELF, &before);
+        int status = execute_simple_command(first);
+        int raw = W_EXITCODE(status & 0xff, 0);
+        set_pipe_status(&raw, 1);
+        if (pipeline->timed) {
+            getrusage(RUSAGE_SELF, &after);
+            rusage_delta(&usage, &before, &after);
+            long long ended_ns = monotonic_ns();
+            char *name = first->arg_count > 0 ? first->args[0] : NULL;
+            print_time_report(1, &name, started_ns, &ended_ns, &usage);
+        }
+        return status;
+    }
+    
+    Job *job = job_create(pipeline->num_commands, pipeline->text, pipeline->text_len);
+    job->timed = pipeline->timed;
+    if (job->timed) {
+        job->names = calloc(pipeline->num_commands, sizeof(char*));
+        for (int i = 0; job->names && i < pipeline->num_commands; i++) {
+            SimpleCommand *cmd = &pipeline->commands[i];
+            job->names[i] = cmd->arg_count > 0 ? strdup(cmd->args[0]) : NULL;
+        }
+    }
+    job->started_ns = monotonic_ns();
+    int status = launch_pipeline(pipeline, job);
+    if (status != 0) {
+        int raw = W_EXITCODE(status, 0);
+        set_pipe_status(&raw, 1);
+        job_free(job);
+        return status;
+    }
+    
+    if (!pipeline->background) {
+        return run_foreground_job(job);
+    }
+    
+    // Background jobs are left running and collected by reap_jobs
+    int started = 0;
+    set_pipe_status(&started, 1);
+    job->background = 1;
+    job->notified = 1;
+    job_add(job);
+    pid_t last_pid = job->pids[job->num_procs - 1] > 0 ? job->pids[job->num_procs - 1] : job->pgid;
+    if (last_pid > 0) {
+        last_background_pid = last_pid;
+    }
+    if (interactive) {
+        fprintf(stderr, "[%d] %d\n", job->id, (int)last_pid);
+    }
+    return 0;
+}
+
+// Function to parse and run one command line
+void execute_command(char *input) {
+    long long parse_start = trace_clock();
+    CommandList *list = parse_command_list(input);
+    trace_event(TRACE_PARSE, parse_start, 0, list ? 0 : 2, input, strlen(input));
+    if (!list) {
+        last_status = 2;
+        return;  // Syntax error already reported
+    }
+    
+    for (int i = 0; i < list->count; i++) {
+        last_status = run_pipeline(list->pipelines[i]);
+    }
+}
+
+// Function to parse and run one line, then release everything parsed from it
+void run_line(char *line) {
+    execute_command(line);
+    arena_reset(&line_arena);
+    reap_jobs();
+    trace_flush();
+}
+
+// Function to set up a reader over a descriptor. Regular files are mapped
+// whole; anything else (pipes, terminals) is read in large blocks.
+void line_reader_open(LineReader *reader, int fd) {
+    memset(reader, 0, sizeof(LineReader));
+    reader->fd = fd;
+    
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset < 0) offset = 0;
+        if (st.st_size == 0 || offset >= st.st_size) {
+            reader->eof = 1;
+            return;
+        }
+        
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            reader->data = data;
+            reader->len = st.st_size;
+            reader->pos = offset;
+            reader->mapped = 1;
+            reader->eof = 1;
+            return;
+        }
+    }
+}
+
+// Function to set up a reader over a string (for -c)
+void line_reader_open_string(LineReader *reader, char *str) {
+    memset(reader, 0, sizeof(LineReader));
+    reader->fd = -1;
+    reader->data = str;
+    reader->len = strlen(str);
+    reader->eof = 1;
+}
+
+// Function to release a reader's buffer or mapping
+void line_reader_close(LineReader *reader) {
+    if (reader->mapped) {
+        munmap(reader->data, reader->len);
+    } else if (reader->fd >= 0) {
+        free(reader->data);
+    }
+    reader->data = NULL;
+}
+
+// Function to get the next line from a reader, without its newline, copied
+// into the line arena. Returns NULL at end of input.
+char* line_reader_next(LineReader *reader) {
+    while (1) {
+        char *start = reader->data + reader->pos;
+        char *newline = reader->pos < reader->len ? memchr(start, '\n', reader->len - reader->pos) : NULL;
+        
+        if (newline || (reader->eof && reader->pos < reader->len)) {
+            size_t line_len = newline ? (size_t)(newline - start) : reader->len - reader->pos;
+            reader->pos += line_len + (newline ? 1 : 0);
+            
+            // Keep a mapped stdin's offset just past this line, so commands
+            // that read stdin see the rest of the file, as with bash
+            if (reader->mapped && reader->fd == STDIN_FILENO) {
+                lseek(reader->fd, reader->pos, SEEK_SET);
+            }
+            return arena_strndup(&line_arena, start, line_len);
+        }
+        
+        if (reader->eof) {
+            return NULL;
+        }
+        
+        // Move the partial line to the front and read another block
+        if (reader->pos > 0) {
+            memmove(reader->data, start, reader->len - reader->pos);
+            reader->len -= reader->pos;
+            reader->pos = 0;
+        }
+        if (reader->len == reader->capacity) {
+            size_t new_capacity = reader->capacity ? reader->capacity * 2 : READER_BUFFER_SIZE;
+            char *data = realloc(reader->data, new_capacity);
+            if (!data) {
+                perror("realloc failed");
+                return NULL;
+            }
+            reader->data = data;
+            reader->capacity = new_capacity;
+        }
+        
+        ssize_t n = read(reader->fd, reader->data + reader->len, reader->capacity - reader->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0) perror("read");
+            reader->eof = 1;
+        } else {
+            reader->len += n;
+        }
+    }
+}
+
+// Reader that run_reader is taking lines from
+LineReader *input_reader = NULL;
+
+// Function to start logging every line the shell reads to a file, with the
+// time since logging began, for --replay. Returns -1 if it can't be opened.
+int open_record(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "--record: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    record_fd = move_fd_high(fd);
+    record_start_ns = monotonic_ns();
+    return 0;
+}
+
+// Function to log one line read, as "<ns since start>\t<line>". Each line
+// is written straight away, so a session that crashes is still recorded.
+void record_line(const char *line) {
+    if (record_fd == -1) {
+        return;
+    }
+    
+    OutBuf out = {0};
+    outbuf_printf(&out, "%lld\t", monotonic_ns() - record_start_ns);
+    outbuf_puts(&out, line);
+    outbuf_puts(&out, "\n");
+    outbuf_flush(&out, record_fd);
+    outbuf_free(&out);
+}
+
+// Function to read a here-document line from the current reader
+char* reader_input_line(const char *prompt) {
+    (void)prompt;  // No prompts without a terminal
+    char *line = input_reader ? line_reader_next(input_reader) : NULL;
+    if (line) record_line(line);
+    return line;
+}
+
+// Function to read a here-document line at the terminal, with a prompt
+char* readline_input_line(const char *prompt) {
+    char *line = readline(prompt);
+    if (!line) {
+        return NULL;
+    }
+    char *copy = arena_strdup(&line_arena, line);
+    free(line);
+    record_line(copy);
+    return copy;
+}
+
+// Function to run every line from a reader (scripts, -c, piped stdin)
+void run_reader(LineReader *reader) {
+    input_reader = reader;
+    read_input_line = reader_input_line;
+    
+    char *line;
+    long long read_start = trace_clock();
+    while ((line = line_reader_next(reader)) != NULL) {
+        trace_event(TRACE_READ, read_start, 0, 0, line, strlen(line));
+        record_line(line);
+        run_line(line);
+        
+        // A command may have read lines of the script from a mapped stdin;
+        // carry on from wherever it left the offset, so they aren't run too
+        if (reader->mapped && reader->fd == STDIN_FILENO) {
+            off_t offset = lseek(reader->fd, 0, SEEK_CUR);
+            if (offset >= 0) reader->pos = (size_t)offset < reader->len ? (size_t)offset : reader->len;
+        }
+        read_start = trace_clock();
+    }
+    line_reader_close(reader);
+    input_reader = NULL;
+}
+
+// Function to get the history file's path: $HISTFILE, or ~/.shell_history.
+// Returns NULL if neither is available.
+char* history_default_path(void) {
+    const char *histfile = get_variable("HISTFILE");
+    if (histfile && *histfile) {
+        return strdup(histfile);
+    }
+    
+    const char *home = get_variable("HOME");
+    char *path;
+    if (!home || asprintf(&path, "%s/.shell_history", home) == -1) {
+        return NULL;
+    }
+    return path;
+}
+
+// Function to map the history file again if it has grown, as it does when
+// this or another shell appends. Returns -1 if it can't be mapped.
+int history_remap(void) {
+    struct stat st;
+    if (fstat(history.fd, &st) == -1) {
+        return -1;
+    }
+    if ((size_t)st.st_size == history.size) {
+        return 0;
+    }
+    
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+    if (data == MAP_FAILED) {
+        perror("history: mmap");
+        return -1;
+    }
+    if (history.data) munmap(history.data, history.size);
+    history.data = data;
+    history.size = st.st_size;
+    return 0;
+}
+
+// Function to find the records appended after the last one seen. A record
+// shorter than its length says is still being written, and is left for later.
+void history_scan(void) {
+    while (history.scanned_bytes + sizeof(uint32_t) <= history.size) {
+        uint32_t len;
+        memcpy(&len, history.data + history.scanned_bytes, sizeof(len));
+        if (len > history.size - history.scanned_bytes - sizeof(uint32_t)) {
+            break;
+        }
+        
+        if (history.tail_count == history.tail_capacity) {
+            int capacity = history.tail_capacity ? history.tail_capacity * 2 : 256;
+            uint64_t *tail = realloc(history.tail, capacity * sizeof(uint64_t));
+            if (!tail) {
+                perror("malloc failed");
+                return;
+            }
+            history.tail = tail;
+            history.tail_capacity = capacity;
+        }
+        history.tail[history.tail_count++] = history.scanned_bytes;
+        history.scanned_bytes += sizeof(uint32_t) + len;
+    }
+}
+
+// Function to drop the mapping of the history index
+void history_unmap_index(void) {
+    if (history.index) munmap(history.index, history.index_size);
+    history.index = NULL;
+    history.index_size = 0;
+    history.index_inode = 0;
+    history.offsets = NULL;
+    history.trigrams = NULL;
+    history.postings = NULL;
+    history.num_trigrams = 0;
+    history.indexed_entries = 0;
+    history.indexed_bytes = 0;
+}
+
+// Function to map the history index, if there is one built from this
+// history file, and collect the entries appended after the part it covers
+void history_load_index(void) {
+    history_unmap_index();
+    
+    int fd = open(history.index_path, O_RDONLY | O_CLOEXEC);
+    struct stat st, history_st;
+    if (fd != -1 && fstat(fd, &st) == 0 && fstat(history.fd, &history_st) == 0 &&
+        (size_t)st.st_size >= sizeof(HistoryIndexHeader)) {
+        char *index = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        const HistoryIndexHeader *header = (const HistoryIndexHeader *)index;
+        
+        // Counts are checked one at a time, so a damaged header can't overflow the sum
+        size_t size = st.st_size;
+        int valid = index != MAP_FAILED && memcmp(header->magic, "SHHIDX1", 8) == 0 &&
+                    header->history_inode == (uint64_t)history_st.st_ino &&
+                    header->history_bytes <= history.size &&
+                    header->num_entries <= size / sizeof(uint64_t) &&
+                    header->num_trigrams <= size / sizeof(HistoryTrigram) &&
+                    header->num_postings <= size / sizeof(uint32_t) &&
+                    sizeof(HistoryIndexHeader) + header->num_entries * sizeof(uint64_t) +
+                    header->num_trigrams * sizeof(HistoryTrigram) +
+                    header->num_postings * sizeof(uint32_t) == size;
+        if (valid) {
+            history.index = index;
+            history.index_size = size;
+            history.index_inode = st.st_ino;
+            history.offsets = (const uint64_t *)(index + sizeof(HistoryIndexHeader));
+            history.trigrams = (const HistoryTrigram *)(history.offsets + header->num_entries);
+            history.postings = (const uint32_t *)(history.trigrams + header->num_trigrams);
+            history.num_trigrams = header->num_trigrams;
+            history.indexed_entries = header->num_entries;
+            history.indexed_bytes = header->history_bytes;
+        } else if (index != MAP_FAILED) {
+            munmap(index, size);
+        }
+    }
+    if (fd != -1) close(fd);
+    
+    history.tail_count = 0;
+    history.scanned_bytes = history.index ? history.indexed_bytes : sizeof(HistoryHeader);
+    history_scan();
+    history.rebuild_at = HISTORY_INDEX_SLACK;
+}
+
+// Function to pick up what other shells appended, and a rebuilt index
+void history_refresh(void) {
+    if (history.fd == -1) {
+        return;
+    }
+    
+    history_remap();
+    struct stat st;
+    if (stat(history.index_path, &st) == 0 && st.st_ino != history.index_inode) {
+        history_load_index();
+    } else {
+        history_scan();
+    }
+}
+
+// Function to get the number of history entries
+long history_count(void) {
+    return history.indexed_entries + history.tail_count;
+}
+
+// Function to get the text of history entry i (from 0, oldest first), which
+// is not NUL-terminated. Returns NULL if there is no such entry.
+const char* history_entry(long i, uint32_t *len) {
+    if (i < 0 || i >= history_count()) {
+        return NULL;
+    }
+    
+    uint64_t offset = (uint64_t)i < history.indexed_entries ? history.offsets[i] : history.tail[i - history.indexed_entries];
+    if (offset + sizeof(uint32_t) > history.size) {
+        return NULL;  // A damaged index
+    }
+    memcpy(len, history.data + offset, sizeof(uint32_t));
+    if (*len > history.size - offset - sizeof(uint32_t)) {
+        return NULL;
+    }
+    return history.data + offset + sizeof(uint32_t);
+}
+
+// Function to get the index key for the three characters at p. Printable
+// ASCII characters keep their identity in 7 bits; all other bytes share one
+// value, which only makes the index less selective, since matches are checked.
+uint32_t history_trigram(const unsigned char *p) {
+    uint32_t key = 0;
+    for (int i = 0; i < 3; i++) {
+        uint32_t c = p[i] >= 0x20 && p[i] < 0x7f ? p[i] - 0x1f : 0;
+        key = key << 7 | c;
+    }
+    return key;
+}
+
+// Function to build the index for the history in data and write it to
+// path, through a temporary file renamed over it so readers never see it
+// half written. Returns -1 on error.
+int history_build_index(const char *path, const char *data, size_t size, ino_t inode) {
+    // First pass: find the records, and count the entries each trigram is in
+    uint32_t *counts = calloc(HISTORY_TRIGRAM_KEYS, sizeof(uint32_t));
+    uint32_t *seen = calloc(HISTORY_TRIGRAM_KEYS, sizeof(uint32_t));  // Last entry counted, plus one
+    uint64_t *offsets = NULL;
+    size_t num_entries = 0;
+    size_t capacity = 0;
+    uint64_t num_postings = 0;
+    size_t pos = sizeof(HistoryHeader);
+    if (!counts || !seen) {
+        free(counts);
+        free(seen);
+        return -1;
+    }
+    
+    while (pos + sizeof(uint32_t) <= size) {
+        uint32_t len;
+        memcpy(&len, data + pos, sizeof(len));
+        if (len > size - pos - sizeof(uint32_t)) break;
+        
+        if (num_entries == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            uint64_t *grown = realloc(offsets, capacity * sizeof(uint64_t));
+            if (!grown) break;
+            offsets = grown;
+        }
+        offsets[num_entries] = pos;
+        
+        const unsigned char *text = (const unsigned char *)data + pos + sizeof(uint32_t);
+        for (uint32_t j = 0; j + 3 <= len; j++) {
+            uint32_t key = history_trigram(text + j);
+            if (seen[key] != num_entries + 1) {
+                seen[key] = num_entries + 1;
+                counts[key]++;
+                num_postings++;
+            }
+        }
+        num_entries++;
+        pos += sizeof(uint32_t) + len;
+    }
+    
+    uint64_t num_trigrams = 0;
+    for (uint32_t key = 0; key < HISTORY_TRIGRAM_KEYS; key++) {
+        if (counts[key]) num_trigrams++;
+    }
+    
+    size_t index_size = sizeof(HistoryIndexHeader) + num_entries * sizeof(uint64_t) +
+                        num_trigrams * sizeof(HistoryTrigram) + num_postings * sizeof(uint32_t);
+    char *index = malloc(index_size);
+    if (!index) {
+        free(counts);
+        free(seen);
+        free(offsets);
+        return -1;
+    }
+    
+    HistoryIndexHeader *header = (HistoryIndexHeader *)index;
+    memset(header, 0, sizeof(HistoryIndexHeader));
+    memcpy(header->magic, "SHHIDX1", 8);
+    header->history_inode = inode;
+    header->history_bytes = pos;
+    header->num_entries = num_entries;
+    header->num_trigrams = num_trigrams;
+    header->num_postings = num_postings;
+    if (num_entries > 0) {
+        memcpy(index + sizeof(HistoryIndexHeader), offsets, num_entries * sizeof(uint64_t));
+    }
+    
+    // Lay out the trigram table, turning each count into its list's write position
+    HistoryTrigram *trigrams = (HistoryTrigram *)(index + sizeof(HistoryIndexHeader) + num_entries * sizeof(uint64_t));
+    uint32_t *postings = (uint32_t *)(trigrams + num_trigrams);
+    uint64_t t = 0;
+    uint32_t next = 0;
+    for (uint32_t key = 0; key < HISTORY_TRIGRAM_KEYS; key++) {
+        if (!counts[key]) continue;
+        trigrams[t].key = key;
+        trigrams[t].count = counts[key];
+        trigrams[t].first = next;
+        t++;
+        uint32_t count = counts[key];
+        counts[key] = next;
+        next += count;
+    }
+    
+    // Second pass: add each entry to its trigrams' lists, which come out in entry order
+    memset(seen, 0, HISTORY_TRIGRAM_KEYS * sizeof(uint32_t));
+    for (size_t e = 0; e < num_entries; e++) {
+        uint32_t len;
+        memcpy(&len, data + offsets[e], sizeof(len));
+        const unsigned char *text = (const unsigned char *)data + offsets[e] + sizeof(uint32_t);
+        for (uint32_t j = 0; j + 3 <= len; j++) {
+            uint32_t key = history_trigram(text + j);
+            if (seen[key] != e + 1) {
+                seen[key] = e + 1;
+                postings[counts[key]++] = e;
+            }
+        }
+    }
+    free(counts);
+    free(seen);
+    free(offsets);
+    
+    char temp[MAX_PATH_LENGTH];
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    OutBuf out = {index, index_size, index_size};
+    int result = fd == -1 ? -1 : outbuf_flush(&out, fd);
+    if (fd != -1 && close(fd) == -1) result = -1;
+    if (result == 0 && rename(temp, path) == -1) result = -1;
+    if (result != 0) unlink(temp);
+    free(index);
+    return result;
+}
+
+// Function to rebuild the history index in the background. A grandchild
+// does the work, so the shell neither waits for it nor has to reap it.
+void history_start_rebuild(void) {
+    history.rebuild_at = history.tail_count + HISTORY_INDEX_SLACK;
+    struct stat st;
+    if (fstat(history.fd, &st) == -1) {
+        return;
+    }
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (fork() == 0) {
+            setsid();  // Away from the terminal, so Ctrl-C in the shell doesn't stop it
+            _exit(history_build_index(history.index_path, history.data, history.size, st.st_ino) == 0 ? 0 : 1);
+        }
+        _exit(0);
+    }
+    while (pid > 0 && waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+    }
+}
+
+// Function to open the history file, creating it with its header if it is
+// new, then map it and its index, and give readline the newest entries.
+// Loading doesn't read the entries the index covers.
+void history_open(void) {
+    history.path = history_default_path();
+    if (!history.path || asprintf(&history.index_path, "%s.idx", history.path) == -1) {
+        return;
+    }
+    
+    int fd = open(history.path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        fprintf(stderr, "history: %s: %s\n", history.path, strerror(errno));
+        return;
+    }
+    fd = move_fd_high(fd);
+    
+    // Whoever finds the file empty writes the header, under the lock appends take
+    HistoryHeader header;
+    struct stat st;
+    flock(fd, LOCK_EX);
+    int valid = fstat(fd, &st) == 0;
+    if (valid && st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "SHHIST1", 8);
+        header.version = 1;
+        header.header_size = sizeof(HistoryHeader);
+        valid = write(fd, &header, sizeof(header)) == sizeof(header);
+    } else if (valid) {
+        valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                memcmp(header.magic, "SHHIST1", 8) == 0 && header.header_size == sizeof(HistoryHeader);
+    }
+    flock(fd, LOCK_UN);
+    if (!valid) {
+        fprintf(stderr, "history: %s: not a history file\n", history.path);
+        close(fd);
+        return;
+    }
+    
+    history.fd = fd;
+    if (history_remap() == -1) {
+        close(fd);
+        history.fd = -1;
+        return;
+    }
+    history_load_index();
+    
+    // Older entries are reached with Ctrl-R and the history builtin
+    long count = history_count();
+    for (long i = count > HISTORY_LOAD_ENTRIES ? count - HISTORY_LOAD_ENTRIES : 0; i < count; i++) {
+        uint32_t len;
+        const char *text = history_entry(i, &len);
+        if (!text) continue;
+        char *line = strndup(text, len);
+        add_history(line);
+        free(line);
+    }
+    rl_bind_keyseq("\\C-r", history_search_key);
+    
+    if (history.tail_count >= history.rebuild_at) {
+        history_start_rebuild();
+    }
+}
+
+// Function to add a line to the history. It is appended to the file with
+// one write under an exclusive lock, so shells sharing the file never
+// interleave their records.
+void history_add(const char *line) {
+    add_history(line);
+    if (history.fd == -1) {
+        return;
+    }
+    
+    uint32_t len = strlen(line);
+    OutBuf record = {0};
+    outbuf_append(&record, (const char *)&len, sizeof(len));
+    outbuf_append(&record, line, len);
+    flock(history.fd, LOCK_EX);
+    ssize_t written = write(history.fd, record.data, record.len);
+    flock(history.fd, LOCK_UN);
+    if (written != (ssize_t)record.len) {
+        perror("history: write");
+    }
+    outbuf_free(&record);
+    
+    history_refresh();
+    if (history.tail_count >= history.rebuild_at) {
+        history_start_rebuild();
+    }
+}
+
+// Function to check whether history entry i contains query
+int history_matches(long i, const char *query, size_t query_len) {
+    uint32_t len;
+    const char *text = history_entry(i, &len);
+    return text && memmem(text, len, query, query_len) != NULL;
+}
+
+// Function to find the newest entry before entry number before that
+// contains query. Entries past the index are scanned; indexed ones are
+// narrowed to those containing the query's rarest trigram, then checked.
+// Returns -1 if there is none.
+long history_find(const char *query, long before) {
+    size_t query_len = strlen(query);
+    long i = (before < history_count() ? before : history_count()) - 1;
+    for (; i >= (long)history.indexed_entries; i--) {
+        if (history_matches(i, query, query_len)) return i;
+    }
+    
+    // Too short for a trigram: check every entry
+    if (query_len < 3 || !history.index) {
+        for (; i >= 0; i--) {
+            if (history_matches(i, query, query_len)) return i;
+        }
+        return -1;
+    }
+    
+    // Every trigram of the query has to be in the index
+    const HistoryTrigram *rarest = NULL;
+    for (size_t j = 0; j + 3 <= query_len; j++) {
+        uint32_t key = history_trigram((const unsigned char *)query + j);
+        long lo = 0;
+        long hi = history.num_trigrams;
+        while (lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+            if (history.trigrams[mid].key < key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == (long)history.num_trigrams || history.trigrams[lo].key != key) {
+            return -1;
+        }
+        if (!rarest || history.trigrams[lo].count < rarest->count) {
+            rarest = &history.trigrams[lo];
+        }
+    }
+    
+    const HistoryIndexHeader *header = (const HistoryIndexHeader *)history.index;
+    if (rarest->first + rarest->count > header->num_postings) {
+        return -1;  // A damaged index
+    }
+    
+    // Walk its list back from the last entry not after i
+    const uint32_t *list = history.postings + rarest->first;
+    long lo = 0;
+    long hi = rarest->count;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if ((long)list[mid] <= i) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (long k = lo - 1; k >= 0; k--) {
+        if (history_matches(list[k], query, query_len)) return list[k];
+    }
+    return -1;
+}
+
+// Function bound to Ctrl-R: replace the line with the newest history entry
+// containing what was typed. Pressing it again moves to older matches.
+int history_search_key(int count, int key) {
+    (void)count;
+    (void)key;
+    history_refresh();
+    if (rl_last_func != history_search_key || !history.search_query) {
+        free(history.search_query);
+        history.search_query = strdup(rl_line_buffer);
+        history.search_pos = history_count();
+    }
+    
+    long i = history.search_pos;
+    while ((i = history_find(history.search_query, i)) >= 0) {
+        uint32_t len;
+        const char *text = history_entry(i, &len);
+        
+        // Skip repeats of the line already shown
+        if (len == (uint32_t)rl_end && memcmp(text, rl_line_buffer, len) == 0) continue;
+        
+        char *line = strndup(text, len);
+        rl_replace_line(line, 0);
+        rl_point = rl_end;
+        free(line);
+        history.search_pos = i;
+        return 0;
+    }
+    rl_ding();
+    return 0;
+}
+
+// Handle the 'history' builtin: 'history [n]' lists the last n entries (all
+// by default), 'history -s text' lists those containing text
+int handle_history(char **args, OutBuf *out) {
+    history_refresh();
+    long count = history_count();
+    
+    if (args[1] && strcmp(args[1], "-s") == 0) {
+        if (!args[2]) {
+            fprintf(stderr, "history: -s: text expected\n");
+            return 2;
+        }
+        
+        // Matches are found newest first, and listed oldest first
+        long *matches = NULL;
+        long num_matches = 0;
+        long capacity = 0;
+        for (long i = history_find(args[2], count); i >= 0; i = history_find(args[2], i)) {
+            if (num_matches == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                long *grown = realloc(matches, capacity * sizeof(long));
+                if (!grown) break;
+                matches = grown;
+            }
+            matches[num_matches++] = i;
+        }
+        for (long m = num_matches - 1; m >= 0; m--) {
+            uint32_t len;
+            const char *text = history_entry(matches[m], &len);
+            if (!text) continue;
+            outbuf_printf(out, "%5ld  ", matches[m] + 1);
+            outbuf_append(out, text, len);
+            outbuf_append(out, "\n", 1);
+        }
+        free(matches);
+        return num_matches > 0 ? 0 : 1;
+    }
+    
+    long first = 0;
+    if (args[1]) {
+        if (!is_number(args[1])) {
+            fprintf(stderr, "history: %s: numeric argument required\n", args[1]);
+            return 2;
+        }
+        long n = atol(args[1]);
+        first = n < count ? count - n : 0;
+    }
+    for (long i = first; i < count; i++) {
+        uint32_t len;
+        const char *text = history_entry(i, &len);
+        if (!text) continue;
+        outbuf_printf(out, "%5ld  ", i + 1);
+        outbuf_append(out, text, len);
+        outbuf_append(out, "\n", 1);
+    }
+    return 0;
+}
+
+// Function to split a recorded line into its time offset and the command
+// line itself. A line without an offset keeps the previous one.
+char* replay_parse_record(char *record, long long *offset_ns) {
+    char *end;
+    long long offset = strtoll(record, &end, 10);
+    if (end == record || *end != '\t') {
+        return record;
+    }
+    *offset_ns = offset;
+    return end + 1;
+}
+
+// Function to read a here-document line from the recording being replayed
+char* replay_input_line(const char *prompt) {
+    (void)prompt;  // No prompts when replaying
+    char *record = replay_reader ? line_reader_next(replay_reader) : NULL;
+    if (!record) {
+        return NULL;
+    }
+    long long offset;
+    return replay_parse_record(record, &offset);
+}
+
+// Function to get the name a replayed line is grouped under: its first
+// word after any NAME=value prefixes. Blank and comment lines get "".
+void replay_command_name(const char *line, char *name, size_t size) {
+    const char *p = line;
+    while (1) {
+        while (is_blank(*p)) p++;
+        const char *start = p;
+        while (*p && !is_blank(*p) && !strchr("|;&<>()'\"`#", *p)) p++;
+        
+        // Skip assignments that prefix a command, but not a lone one
+        const char *equals = memchr(start, '=', p - start);
+        const char *next = p;
+        while (is_blank(*next)) next++;
+        if (equals && is_valid_name(start, equals - start) && *next && *next != '#') {
+            continue;
+        }
+        
+        size_t len = p - start;
+        if (len >= size) len = size - 1;
+        memcpy(name, start, len);
+        name[len] = '\0';
+        return;
+    }
+}
+
+// Function to add one replayed line's latency to its command's group
+void replay_add_latency(const char *name, long long ns, int status) {
+    ReplayGroup *group = NULL;
+    for (int i = 0; i < num_replay_groups; i++) {
+        if (strcmp(replay_groups[i].name, name) == 0) {
+            group = &replay_groups[i];
+            break;
+        }
+    }
+    
+    if (!group) {
+        ReplayGroup *groups = realloc(replay_groups, (num_replay_groups + 1) * sizeof(ReplayGroup));
+        if (!groups) {
+            perror("malloc failed");
+            exit(1);
+        }
+        replay_groups = groups;
+        group = &replay_groups[num_replay_groups++];
+        memset(group, 0, sizeof(ReplayGroup));
+        group->name = strdup(name);
+    }
+    
+    if (group->count == group->capacity) {
+        int capacity = group->capacity ? group->capacity * 2 : 16;
+        long long *latencies = realloc(group->latencies, capacity * sizeof(long long));
+        if (!latencies) {
+            perror("malloc failed");
+            exit(1);
+        }
+        group->latencies = latencies;
+        group->capacity = capacity;
+    }
+    group->latencies[group->count++] = ns;
+    if (status != 0) group->failed++;
+}
+
+// Compare two latencies for qsort
+int compare_latencies(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Compare two replay groups for qsort, busiest first
+int compare_replay_groups(const void *a, const void *b) {
+    const ReplayGroup *x = a;
+    const ReplayGroup *y = b;
+    if (x->count != y->count) {
+        return y->count - x->count;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// Function to format a latency with a unit that suits its size
+void format_latency(char *buf, size_t size, long long ns) {
+    if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.2fms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.3fs", ns / 1e9);
+    }
+}
+
+// Function to add one row of the latency table. latencies must be sorted;
+// percentiles are nearest-rank.
+void print_replay_row(OutBuf *out, const char *name, const long long *latencies, int count, int failed) {
+    char p50[16], p99[16], max[16];
+    format_latency(p50, sizeof(p50), latencies[(count * 50 + 99) / 100 - 1]);
+    format_latency(p99, sizeof(p99), latencies[(count * 99 + 99) / 100 - 1]);
+    format_latency(max, sizeof(max), latencies[count - 1]);
+    outbuf_printf(out, "%-20s %8d %8d %10s %10s %10s\n", name, count, failed, p50, p99, max);
+}
+
+// Function to print the --replay report to stderr: latency percentiles per
+// command, a histogram over every line, and what the shell did while running them
+void print_replay_report(void) {
+    OutBuf out = {0};
+    int total = 0;
+    int failed = 0;
+    for (int i = 0; i < num_replay_groups; i++) {
+        total += replay_groups[i].count;
+        failed += replay_groups[i].failed;
+    }
+    char elapsed[16];
+    format_latency(elapsed, sizeof(elapsed), monotonic_ns() - replay_started_ns);
+    outbuf_printf(&out, "\nreplay: %d lines in %s, %d with a non-zero status\n\n", total, elapsed, failed);
+    
+    if (total > 0) {
+        long long *all = malloc(total * sizeof(long long));
+        if (!all) {
+            perror("malloc failed");
+            exit(1);
+        }
+        
+        qsort(replay_groups, num_replay_groups, sizeof(ReplayGroup), compare_replay_groups);
+        outbuf_printf(&out, "%-20s %8s %8s %10s %10s %10s\n", "command", "lines", "failed", "p50", "p99", "max");
+        int n = 0;
+        for (int i = 0; i < num_replay_groups; i++) {
+            ReplayGroup *group = &replay_groups[i];
+            qsort(group->latencies, group->count, sizeof(long long), compare_latencies);
+            print_replay_row(&out, group->name, group->latencies, group->count, group->failed);
+            memcpy(all + n, group->latencies, group->count * sizeof(long long));
+            n += group->count;
+        }
+        qsort(all, total, sizeof(long long), compare_latencies);
+        print_replay_row(&out, "(all)", all, total, failed);
+        
+        // Power-of-two buckets from 1us up
+        int buckets[40] = {0};
+        int min_bucket = 39;
+        int max_bucket = 0;
+        for (int i = 0; i < total; i++) {
+            int b = 0;
+            while (b < 39 && (1000LL << b) < all[i]) b++;
+            buckets[b]++;
+            if (b < min_bucket) min_bucket = b;
+            if (b > max_bucket) max_bucket = b;
+        }
+        int peak = 0;
+        for (int b = min_bucket; b <= max_bucket; b++) {
+            if (buckets[b] > peak) peak = buckets[b];
+        }
+        outbuf_puts(&out, "\nlatency histogram (all lines)\n");
+        for (int b = min_bucket; b <= max_bucket; b++) {
+            char bound[16];
+            format_latency(bound, sizeof(bound), 1000LL << b);
+            outbuf_printf(&out, "  <= %-10s %8d ", bound, buckets[b]);
+            for (int j = 0; j < (buckets[b] * 50 + peak - 1) / peak; j++) {
+                outbuf_append(&out, "#", 1);
+            }
+            outbuf_puts(&out, "\n");
+        }
+        free(all);
+    }
+    
+    // The shell counts its own calls; there is no syscall tracing here
+    outbuf_puts(&out, "\ncalls made by the shell (counted where it makes them, not traced)\n ");
+    for (int i = 0; i < TRACE_EVENT_TYPES; i++) {
+        outbuf_printf(&out, " %s %lu", trace_event_names[i], trace_counts[i]);
+    }
+    outbuf_puts(&out, "\n");
+    
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    outbuf_printf(&out, "\n%-10s %10s %10s %12s %12s\n", "", "user", "sys", "voluntary", "involuntary");
+    outbuf_printf(&out, "%-10s %9.3fs %9.3fs %12ld %12ld\n", "shell",
+                  self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1e6,
+                  self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1e6, self.ru_nvcsw, self.ru_nivcsw);
+    outbuf_printf(&out, "%-10s %9.3fs %9.3fs %12ld %12ld\n", "commands",
+                  children.ru_utime.tv_sec + children.ru_utime.tv_usec / 1e6,
+                  children.ru_stime.tv_sec + children.ru_stime.tv_usec / 1e6, children.ru_nvcsw, children.ru_nivcsw);
+    outbuf_flush(&out, STDERR_FILENO);
+    outbuf_free(&out);
+}
+
+// Function to print the replay report once, from the replaying shell. Also
+// runs at exit, for recordings that end with the exit builtin.
+void finish_replay(void) {
+    if (replay_pid != getpid()) {
+        return;
+    }
+    replay_pid = 0;
+    print_replay_report();
+}
+
+// Function to run the lines of a --record file again, without a terminal.
+// With speed > 0 the recorded pacing is kept, sped up by that factor;
+// otherwise lines run back to back. Returns the last line's status.
+int run_replay(const char *path, double speed) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "--replay: %s: %s\n", path, strerror(errno));
+        return 127;
+    }
+    
+    LineReader reader;
+    line_reader_open(&reader, fd);
+    replay_reader = &reader;
+    read_input_line = replay_input_line;
+    replay_pid = getpid();
+    trace_counting = 1;
+    atexit(finish_replay);
+    
+    replay_started_ns = monotonic_ns();
+    long long offset = 0;
+    char *record;
+    long long read_start = trace_clock();
+    while ((record = line_reader_next(&reader)) != NULL) {
+        char *line = replay_parse_record(record, &offset);
+        trace_event(TRACE_READ, read_start, 0, 0, line, strlen(line));
+        
+        if (speed > 0) {
+            long long wait_ns = replay_started_ns + (long long)(offset / speed) - monotonic_ns();
+            struct timespec delay = {wait_ns / 1000000000LL, wait_ns % 1000000000LL};
+            while (wait_ns > 0 && nanosleep(&delay, &delay) == -1 && errno == EINTR) {
+            }
+        }
+        
+        // The line lives in the arena run_line resets, so name it first
+        char name[32];
+        replay_command_name(line, name, sizeof(name));
+        long long start = monotonic_ns();
+        run_line(line);
+        if (name[0]) replay_add_latency(name, monotonic_ns() - start, last_status);
+        read_start = trace_clock();
+    }
+    
+    finish_replay();
+    line_reader_close(&reader);
+    close(fd);
+    replay_reader = NULL;
+    return last_status;
+}
@@ -0,0 +1,699 @@
+#ifndef SHELL_H
+#define SHELL_H
+
+// Types, globals and functions of the shell, shared by the shell executable
+// (main.c) and the benchmarks in bench/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/resource.h>  // For struct rusage
+#include <signal.h>
+#include <pthread.h>  // For pthread_t
+#include <time.h>
+
+#define MAX_PATH_LENGTH 1024
+#define HASH_BUCKETS 64
+#define DIR_CACHE_BUCKETS 256
+#define COMPLETION_RECHECK_NS 1000000000LL
+#define ARENA_BLOCK_SIZE 8192
+#define ARENA_KEEP_BLOCKS 16
+#define SCAN_MAX_SET 16
+#define SCAN_SCALAR_PREFIX 16      // Bytes checked one at a time before a vector scan
+#define SCAN_VECTOR_MIN 64         // Shorter input is only scanned one byte at a time
+#define VAR_BUCKETS 256
+#define TRACE_RING_EVENTS 4096
+#define TRACE_NAME_LENGTH 48
+#define TRACE_EVENT_TYPES 9
+#define BATCH_HEADROOM 2048
+#define READER_BUFFER_SIZE 65536
+#define HISTORY_INDEX_SLACK 256      // Unindexed history entries before the index is rebuilt
+#define HISTORY_LOAD_ENTRIES 1000    // Newest entries readline gets for the arrow keys
+#define HISTORY_TRIGRAM_KEYS (1 << 21)
+
+// Kinds of redirection, after the parser has resolved the operator
+typedef enum {
+    REDIR_OUTPUT,     // [n]>file
+    REDIR_APPEND,     // [n]>>file
+    REDIR_INPUT,      // [n]<file
+    REDIR_READWRITE,  // [n]<>file
+    REDIR_DUP,        // [n]>&m or [n]<&m
+    REDIR_CLOSE,      // [n]>&- or [n]<&-
+    REDIR_HEREDOC     // [n]<<word, [n]<<-word or [n]<<<word
+} RedirType;
+
+// Structure to hold the text of a here-document or here-string
+typedef struct {
+    char *delimiter;  // Line that ends the body (NULL for a here-string)
+    int strip_tabs;   // Whether leading tabs are removed (<<-)
+    char *body;       // Text fed to the command
+    size_t len;
+    int expand;       // Whether the body has substitutions to run (unquoted delimiter)
+} HereDoc;
+
+// Structure to hold redirection information
+typedef struct {
+    int fd;           // File descriptor to redirect (1 for stdout)
+    RedirType type;
+    char *filename;   // Target filename for file redirections
+    int src_fd;       // Descriptor copied by REDIR_DUP
+    HereDoc *heredoc; // Body for REDIR_HEREDOC
+    int expand;       // Whether filename is raw text with substitutions to run
+} Redirection;
+
+// Structure to hold the executables found in one PATH directory
+typedef struct {
+    char *dir;               // Directory name from PATH
+    struct timespec mtime;   // Directory mtime when it was last read
+    int scanned;             // Whether the directory has been read yet
+    char **names;            // Executable names in the directory
+    int count;
+    int capacity;
+} IndexedDir;
+
+// Structure to hold the persistent tab completion index
+typedef struct {
+    char *path;              // PATH value the directory list was built from
+    IndexedDir *dirs;        // One entry per PATH directory
+    int num_dirs;
+    const char **names;      // Sorted, de-duplicated executables and builtins
+    int count;
+    long long checked_ns;    // When directory mtimes were last checked
+} CompletionIndex;
+
+// Structure to hold one process substitution, <(cmd) or >(cmd)
+typedef struct {
+    int arg_index;            // Argument replaced by /dev/fd/N
+    int output;               // Whether it is >(cmd), which reads what the command writes
+    char *command;            // Command line run in the substituted process
+} ProcSubst;
+
+// Structure to hold one simple command and its redirections
+typedef struct {
+    char **args;              // NULL-terminated argument vector
+    int arg_count;            // Number of arguments
+    int arg_capacity;         // Slots allocated in args
+    Redirection *redirs;      // Redirections, in the order they were written
+    int num_redirs;           // Number of redirections
+    int redir_capacity;       // Slots allocated in redirs
+    ProcSubst *substs;        // Process substitutions among the arguments
+    int num_substs;
+    int *expansions;          // Arguments kept as raw text, expanded when the command runs
+    int num_expansions;
+    char **assigns;           // NAME=value words before the command name, as raw text
+    int num_assigns;
+    int expanded;             // Whether expand_command has run on it
+} SimpleCommand;
+
+// Structure to hold pipeline components
+typedef struct {
+    SimpleCommand *commands;  // Commands joined by pipes
+    int num_commands;         // Number of commands in pipeline
+    int background;           // Whether the pipeline ended with &
+    int timed;                // Whether it was prefixed with the time keyword
+    const char *text;         // Source text of the pipeline (not terminated)
+    size_t text_len;
+} Pipeline;
+
+// Structure to hold the pipelines of one line, separated by ; or &
+typedef struct {
+    Pipeline **pipelines;
+    int count;
+    int capacity;
+} CommandList;
+
+// Kinds of token produced by the lexer
+typedef enum {
+    TOKEN_WORD,               // Word with quotes and escapes already removed
+    TOKEN_PIPE,               // |
+    TOKEN_REDIRECT,           // A redirection operator (see RedirOp)
+    TOKEN_AMP,                // &
+    TOKEN_SEMI,               // ;
+    TOKEN_SUBST,              // <(cmd) or >(cmd)
+    TOKEN_END                 // End of the line
+} TokenType;
+
+// Redirection operators, as written
+typedef enum {
+    REDIR_OP_GREAT,           // >
+    REDIR_OP_DGREAT,          // >>
+    REDIR_OP_LESS,            // <
+    REDIR_OP_LESSGREAT,       // <>
+    REDIR_OP_GREATAND,        // >&
+    REDIR_OP_LESSAND,         // <&
+    REDIR_OP_ANDGREAT,        // &>
+    REDIR_OP_ANDDGREAT,       // &>>
+    REDIR_OP_DLESS,           // <<
+    REDIR_OP_DLESSDASH,       // <<-
+    REDIR_OP_TLESS            // <<<
+} RedirOp;
+
+// Structure to hold one token
+typedef struct {
+    TokenType type;
+    char *text;               // Word contents for TOKEN_WORD
+    RedirOp op;               // Operator of a TOKEN_REDIRECT
+    int fd;                   // Redirected descriptor for TOKEN_REDIRECT
+    int fd_given;             // Whether the descriptor was written before the operator
+    int subst_output;         // Whether a TOKEN_SUBST is >(cmd)
+} Token;
+
+// Structure to hold a set of characters the lexer scans for, with the
+// tables each scan compares against, built on first use
+typedef struct {
+    const char *chars;
+    size_t len;
+    int ready;                // Whether the tables below are built
+    uint64_t bits[4];         // One bit per byte value, for the scalar scan
+    unsigned char needles[SCAN_MAX_SET][32] __attribute__((aligned(32)));  // Each character, repeated
+} ScanSet;
+
+// Lexer state for one input line
+typedef struct {
+    const char *pos;          // Next unread character
+    const char *end;          // End of the line
+    const char *token_start;  // Where the last token began
+    char *word;               // Word being assembled
+    size_t word_len;          // Length of the word so far
+    size_t word_capacity;     // Bytes allocated for word
+    HereDoc **heredocs;       // Here-documents whose bodies follow the line
+    int num_heredocs;
+    int heredoc_capacity;
+    int expand;               // Whether substitutions run now, rather than being marked
+    int needs_expansion;      // Whether the last word has substitutions to run later
+    SimpleCommand *fields;    // Where expanded words are split into, or NULL for no splitting
+    int field_started;        // Whether the word so far had quotes, so it is kept even if empty
+} Lexer;
+
+// Structure to hold a remembered command location (see the hash builtin)
+typedef struct HashEntry {
+    char *name;              // Command name as typed
+    char *path;              // Full path it resolved to
+    int hits;                // Number of times it was executed through the table
+    struct HashEntry *next;  // Next entry in the same bucket
+} HashEntry;
+
+// Structure to hold a shell variable
+typedef struct Variable {
+    char *name;
+    char *value;             // NULL for a name exported before it was given a value
+    int exported;            // Whether commands get it in their environment
+    struct Variable *next;   // Next variable in the same bucket
+} Variable;
+
+// Structure to hold a variable's state from before a prefix assignment
+typedef struct {
+    char *name;
+    char *value;
+    int existed;
+    int exported;
+} SavedVariable;
+
+// Phases recorded by the execution trace (see SHELL_TRACE)
+typedef enum {
+    TRACE_READ,       // Reading a command line
+    TRACE_PARSE,      // Parsing it
+    TRACE_LOOKUP,     // Resolving a command through the hash table and PATH
+    TRACE_PIPE,       // Creating a pipe
+    TRACE_SPAWN,      // Starting a process with posix_spawn
+    TRACE_FORK,       // Starting a process with fork
+    TRACE_EXEC,       // A process replacing itself with the command
+    TRACE_WAIT,       // Waiting for a foreground job
+    TRACE_REAP        // Collecting a finished process
+} TraceEventType;
+
+// Structure to hold one trace event, kept unformatted until it is flushed
+typedef struct {
+    TraceEventType type;
+    long long ts_ns;                  // When the phase started (CLOCK_MONOTONIC)
+    long long dur_ns;
+    pid_t pid;                        // Process involved, or 0
+    int status;                       // Exit status, or 0
+    char name[TRACE_NAME_LENGTH];     // Command name or line, truncated
+} TraceEvent;
+
+// Structure to hold a directory known to exist (see ensure_directory)
+typedef struct DirCacheEntry {
+    char *path;                  // Directory path as written
+    struct DirCacheEntry *next;  // Next entry in the same bucket
+} DirCacheEntry;
+
+// Structure to hold one block of arena memory
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;  // Next block in the chain
+    size_t size;              // Usable bytes in data
+    size_t used;              // Bytes handed out so far
+    max_align_t data[];       // Block contents
+} ArenaBlock;
+
+// Bump allocator whose allocations are all released together
+typedef struct {
+    ArenaBlock *head;         // First block (kept across resets)
+    ArenaBlock *current;      // Block allocations are taken from
+} Arena;
+
+// Structure to collect a builtin's output, so it is written with one syscall
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} OutBuf;
+
+// Structure to hold a source of lines for non-interactive mode
+typedef struct {
+    int fd;                   // Descriptor being read, or -1 for a string
+    char *data;               // Mapped file, read buffer or string
+    size_t len;               // Bytes valid in data
+    size_t pos;               // Next unread byte
+    size_t capacity;          // Size of the read buffer
+    int mapped;               // Whether data is an mmap of the whole file
+    int eof;                  // Whether fd has reached end of file
+} LineReader;
+
+// Header at the start of the history file. Records follow it, each a
+// uint32_t length and that many bytes of command line.
+typedef struct {
+    char magic[8];           // "SHHIST1"
+    uint32_t version;
+    uint32_t header_size;    // Where the first record starts
+} HistoryHeader;
+
+// Header of the history index (the history file's name plus ".idx"). It is
+// followed by num_entries record offsets (uint64_t), num_trigrams
+// HistoryTrigram entries sorted by key, and num_postings entry numbers
+// (uint32_t), ascending within each trigram.
+typedef struct {
+    char magic[8];           // "SHHIDX1"
+    uint64_t history_inode;  // History file the index was built from
+    uint64_t history_bytes;  // Length of the prefix of it that is indexed
+    uint64_t num_entries;
+    uint64_t num_trigrams;
+    uint64_t num_postings;
+} HistoryIndexHeader;
+
+// Structure to hold one trigram of the history index and where its entries are
+typedef struct {
+    uint32_t key;            // Three characters, 7 bits each (see history_trigram)
+    uint32_t count;          // Entries containing it
+    uint64_t first;          // Position of its first entry in the postings
+} HistoryTrigram;
+
+// Structure to hold the open history file, its index, and the entries
+// appended after the indexed part
+typedef struct {
+    char *path;
+    char *index_path;
+    int fd;                  // History file, opened for appending, or -1
+    char *data;              // Mapping of the history file
+    size_t size;
+    char *index;             // Mapping of the index, or NULL
+    size_t index_size;
+    ino_t index_inode;       // Index file that is mapped, to notice a rebuild
+    const uint64_t *offsets;
+    const HistoryTrigram *trigrams;
+    const uint32_t *postings;
+    uint64_t num_trigrams;
+    uint64_t indexed_entries;
+    uint64_t indexed_bytes;
+    uint64_t *tail;          // Offsets of the entries after the indexed part
+    int tail_count;
+    int tail_capacity;
+    size_t scanned_bytes;    // End of the last complete record seen
+    int rebuild_at;          // tail_count that starts the next index rebuild
+    char *search_query;      // Text Ctrl-R is searching for
+    long search_pos;         // Entry the last Ctrl-R match was, or the entry count
+} History;
+
+// Structure to hold the latencies of replayed lines that run one command
+typedef struct {
+    char *name;              // First word of the lines
+    long long *latencies;    // How long each line took to run, in nanoseconds
+    int count;
+    int capacity;
+    int failed;              // Lines that finished with a non-zero status
+} ReplayGroup;
+
+// Ways of starting an external command (see 'set -o spawn=...')
+typedef enum {
+    SPAWN_BACKEND_POSIX,     // posix_spawn with file actions
+    SPAWN_BACKEND_FORK       // fork, set up descriptors, execv
+} SpawnBackend;
+
+// Kinds of descriptor setup a spawned child performs before exec
+typedef enum {
+    SPAWN_OPEN,              // Open path onto fd
+    SPAWN_DUP2,              // Duplicate src_fd onto fd
+    SPAWN_CLOSE,             // Close fd
+    SPAWN_TCSETPGRP          // Make the child's group the foreground group of fd's terminal
+} SpawnActionType;
+
+// Structure to hold one descriptor setup step for a spawned child
+typedef struct {
+    SpawnActionType type;
+    int fd;                  // Descriptor in the child
+    int src_fd;              // Source descriptor for SPAWN_DUP2
+    const char *path;        // File for SPAWN_OPEN
+    int flags;               // open() flags for SPAWN_OPEN
+} SpawnAction;
+
+// States of a job, and of each process in it
+typedef enum {
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+} JobState;
+
+// Structure to hold output a helper thread finishes writing into a pipe
+typedef struct {
+    int fd;                  // Write end of the pipe (the thread's own copy)
+    char *data;              // Output to write, freed by the thread
+    size_t len;
+    size_t written;          // Bytes already written
+    pthread_t thread;
+    int broken;              // Whether the reader quit before it was all written
+} PipeWriter;
+
+// Structure to hold a pipeline that runs as one job
+typedef struct {
+    int id;                  // Job number (%n), or 0 if not in the job table
+    pid_t pgid;              // Process group, when job control is on
+    int num_procs;           // One per pipeline stage
+    pid_t *pids;             // Stage processes; 0 if a stage has none
+    JobState *states;        // State of each stage's process
+    int *statuses;           // Wait status of each stage once it is done
+    PipeWriter **writers;    // Threads finishing in-shell stages' output, or NULL
+    char *command;           // Command text for jobs, fg and bg
+    int background;          // Whether the job was started or resumed with &/bg
+    int notified;            // Whether the latest state change was reported
+    pid_t *subst_pids;       // Process substitutions, reaped when the job is freed
+    int num_substs;
+    struct rusage *usage;    // Resources each stage used, from wait4
+    long long started_ns;    // When the job was launched (CLOCK_MONOTONIC)
+    long long *ended_ns;     // When each stage finished, or 0
+    int timed;               // Whether to print a time report when it finishes
+    char **names;            // Stage command names for the time report
+} Job;
+
+// Structure to hold the items collected for one batch invocation
+typedef struct {
+    char *data;               // Item bytes, each NUL-terminated
+    size_t used;
+    size_t capacity;
+    size_t *offsets;          // Where each item starts in data
+    int count;
+    int offset_capacity;
+    size_t space;             // Exec space the items need
+} BatchItems;
+
+// Globals, defined in shell.c
+extern const char *builtins[];
+extern const int num_builtins;
+extern const char *redir_op_text[];
+extern const char word_special_chars[];
+extern const char dquote_special_chars[];
+extern ScanSet word_scan_set;
+extern ScanSet dquote_scan_set;
+extern ScanSet quote_scan_set;
+extern ScanSet heredoc_scan_set;
+extern char* (*read_input_line)(const char *prompt);
+extern HashEntry *command_hash[HASH_BUCKETS];
+extern char *command_hash_path;
+extern Variable *variables[VAR_BUCKETS];
+extern char **exported_env;
+extern int exported_env_count;
+extern int exported_env_dirty;
+extern const char *trace_event_names[];
+extern TraceEvent *trace_ring;
+extern unsigned long trace_head;
+extern unsigned long trace_flushed;
+extern int trace_fd;
+extern pid_t trace_pid;
+extern unsigned long trace_counts[TRACE_EVENT_TYPES];
+extern int trace_counting;
+extern int record_fd;
+extern long long record_start_ns;
+extern ReplayGroup *replay_groups;
+extern int num_replay_groups;
+extern LineReader *replay_reader;
+extern long long replay_started_ns;
+extern pid_t replay_pid;
+extern History history;
+extern DirCacheEntry *dir_cache[DIR_CACHE_BUCKETS];
+extern CompletionIndex completion_index;
+extern Arena line_arena;
+extern SpawnBackend spawn_backend;
+extern long pipe_size;
+extern Job **job_table;
+extern int num_jobs;
+extern int job_capacity;
+extern int interactive;
+extern int job_control;
+extern pid_t shell_pgid;
+extern int sigchld_pipe[2];
+extern int last_status;
+extern pid_t last_background_pid;
+extern const char *shell_name;
+extern LineReader *input_reader;
+
+// Arena and output buffers
+void* arena_alloc(Arena *arena, size_t size);
+char* arena_strndup(Arena *arena, const char *str, size_t len);
+char* arena_strdup(Arena *arena, const char *str);
+void* arena_realloc(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+void arena_reset(Arena *arena);
+void outbuf_reserve(OutBuf *out, size_t len);
+void outbuf_append(OutBuf *out, const char *str, size_t len);
+void outbuf_puts(OutBuf *out, const char *str);
+void outbuf_printf(OutBuf *out, const char *format, ...);
+int outbuf_flush(OutBuf *out, int fd);
+void outbuf_free(OutBuf *out);
+
+// Hashing, clocks and the execution trace
+unsigned int hash_string(const char *str);
+long long monotonic_ns(void);
+long long trace_clock(void);
+void trace_event(TraceEventType type, long long start_ns, pid_t pid, int status,
+                 const char *name, size_t name_len);
+void format_trace_event(OutBuf *out, TraceEventType type, long long ts_ns, long long dur_ns,
+                        pid_t pid, int status, const char *name);
+void trace_flush(void);
+
+// Variables and the command environment
+int is_valid_name(const char *name, size_t len);
+Variable* find_variable(const char *name);
+const char* get_variable(const char *name);
+void set_variable(const char *name, const char *value, int exported);
+int unset_variable(const char *name);
+void import_environment(void);
+void init_trace(void);
+char** shell_environment(void);
+int same_variable_name(const char *a, const char *b);
+char** command_environment(SimpleCommand *cmd);
+void apply_assignments(SimpleCommand *cmd, SavedVariable *saved, int exported);
+void restore_assignments(SimpleCommand *cmd, SavedVariable *saved);
+
+// Tab completion
+void index_directory(IndexedDir *entry);
+int compare_names(const void *a, const void *b);
+void merge_completion_index(void);
+void free_indexed_dirs(void);
+void refresh_completion_index(void);
+int completion_index_lower_bound(const char *prefix);
+char* command_generator(const char* text, int state);
+char** command_completion(const char* text, int start, int end);
+void init_readline(void);
+
+// Command lookup and the hash table
+int is_builtin(const char *cmd);
+char* search_path(const char *cmd);
+void hash_flush(void);
+void hash_check_path(void);
+HashEntry* hash_lookup(const char *name);
+HashEntry* hash_insert(const char *name, const char *path);
+int hash_delete(const char *name);
+char* find_executable(const char *cmd);
+void print_type(const char *name, OutBuf *out);
+int handle_hash(char **args, OutBuf *out);
+
+// Directory cache
+int dir_cache_contains(const char *path);
+void dir_cache_add(const char *path);
+void dir_cache_flush(void);
+int ensure_directory(char *path);
+void create_parent_directories(const char *filename);
+
+// Lexer
+int is_blank(char c);
+void scan_set_init(ScanSet *set);
+const char* scan_special_scalar(const char *p, const char *end, const ScanSet *set);
+#if defined(__x86_64__) || defined(__i386__)
+const char* scan_special_avx2(const char *p, const char *end, const ScanSet *set);
+const char* scan_special_sse2(const char *p, const char *end, const ScanSet *set);
+#endif
+const char* scan_special(const char *p, const char *end, ScanSet *set);
+const char* scan_word_chars(const char *p, const char *end);
+const char* scan_dquote_chars(const char *p, const char *end);
+void lexer_append(Lexer *lexer, const char *str, size_t len);
+const char* find_closing_paren(const char *p, const char *end);
+void add_argument(SimpleCommand *cmd, const char *text, size_t len);
+void lexer_append_fields(Lexer *lexer, const char *text, size_t len, int quoted);
+int is_valid_subscript(const char *index, size_t len);
+int is_special_parameter(char c);
+int is_positional_name(const char *name, size_t len);
+int lex_variable(Lexer *lexer, int quoted);
+int lex_substitution(Lexer *lexer, int quoted);
+int lex_word(Lexer *lexer, Token *token);
+int lexer_next(Lexer *lexer, Token *token);
+
+// Parser
+void syntax_error(Token *token);
+SimpleCommand* add_command(Pipeline *pipeline, int *capacity);
+void add_redirection(SimpleCommand *cmd, int fd, RedirType type, const char *filename, int src_fd);
+void add_expansion(SimpleCommand *cmd, const char *raw, size_t len);
+int is_assignment(const char *start, const char *end);
+void add_assignment(SimpleCommand *cmd, const char *raw, size_t len);
+void add_substitution(SimpleCommand *cmd, int output, char *command);
+int is_number(const char *word);
+void add_heredoc(Lexer *lexer, SimpleCommand *cmd, Token *op, const char *word);
+void read_heredoc_bodies(Lexer *lexer);
+int add_redirection_op(Lexer *lexer, SimpleCommand *cmd, Token *op, const char *word);
+Pipeline* parse_pipeline(Lexer *lexer, TokenType *terminator);
+CommandList* parse_command_list(const char *input);
+
+// Starting processes
+long arg_max_limit(void);
+size_t exec_string_space(const char *str);
+size_t environment_space(char **envp);
+int check_exec_size(char **args, char **envp);
+void shell_signal_set(sigset_t *set);
+void reset_child_signals(void);
+pid_t spawn_command(const char *exec_path, char **args, char **envp, SpawnAction *actions, int num_actions, pid_t pgid);
+int make_pipe(int fds[2]);
+
+// The batch builtin
+int batch_add_item(BatchItems *items, const char *item, size_t len);
+void batch_wait_oldest(pid_t *running, int *num_running, int *status);
+void batch_spawn(const char *exec_path, char **command, int num_fixed, BatchItems *items,
+                 pid_t *running, int *num_running, int max_procs, int *status);
+int handle_batch(char **args);
+
+// Jobs
+Job* job_create(int num_procs, const char *text, size_t text_len);
+int exit_status(int status);
+void job_free(Job *job);
+JobState job_state(Job *job);
+void job_record(Job *job, int i, int status, const struct rusage *usage);
+void rusage_delta(struct rusage *delta, const struct rusage *before, const struct rusage *after);
+void print_time_line(OutBuf *out, const char *label, double seconds);
+void print_time_report(int num_stages, char **names, long long started_ns,
+                       const long long *ended_ns, const struct rusage *usage);
+void print_job_times(Job *job);
+void set_pipe_status(const int *statuses, int count);
+void job_add(Job *job);
+void job_remove(Job *job);
+Job* job_find(const char *spec);
+void print_job(Job *job, OutBuf *out);
+void sigchld_handler(int sig);
+void reap_jobs(void);
+void notify_jobs(void);
+void wait_for_process(Job *job, int i);
+void wait_for_job(Job *job);
+int run_foreground_job(Job *job);
+void continue_job(Job *job);
+void init_jobs(void);
+int handle_jobs(char **args, OutBuf *out);
+int handle_wait(char **args);
+int handle_fg(char **args, OutBuf *out);
+int handle_bg(char **args, OutBuf *out);
+
+// Builtins
+void handle_echo(char **args, OutBuf *out);
+void handle_pwd(OutBuf *out);
+int handle_cd(char **args);
+long parse_size(const char *str);
+int set_pipe_size(const char *value);
+int handle_set(char **args, OutBuf *out);
+void list_variables(const char *builtin, int exported, OutBuf *out);
+int declare_variables(char **args, int exported);
+int handle_export(char **args, OutBuf *out);
+int handle_local(char **args, OutBuf *out);
+int handle_unset(char **args);
+int is_output_builtin(const char *name);
+int run_output_builtin(char **args, OutBuf *out);
+int run_builtin(char **args);
+
+// Redirections
+int redirection_flags(Redirection *redir);
+int move_fd_high(int fd);
+int open_heredoc(HereDoc *heredoc);
+int open_redirection(Redirection *redir);
+int apply_redirections(SimpleCommand *cmd, int *saved);
+void restore_redirections(SimpleCommand *cmd, int *saved);
+int run_builtin_redirected(SimpleCommand *cmd);
+int add_redirection_actions(SimpleCommand *cmd, SpawnAction *actions, int num_actions, int *opened, int *num_opened);
+
+// Executor
+void* pipe_writer_thread(void *arg);
+int write_stage_output(int fd, char *data, size_t len, PipeWriter **writer);
+int run_stage_in_shell(SimpleCommand *cmd, int out_fd, PipeWriter **writer);
+int report_not_found(SimpleCommand *cmd);
+void free_exec_paths(char **exec_paths, int count);
+void enter_subshell(void);
+char* expand_word(const char *raw, SimpleCommand *fields);
+void expand_heredoc(HereDoc *heredoc);
+void expand_command(SimpleCommand *cmd);
+void capture_command(char *command, OutBuf *out);
+int start_substitutions(SimpleCommand *cmd, Job *job, int take_terminal,
+                        int (*pipefd)[2], int num_pipes, int *fds);
+void close_substitution_fds(int *fds, int count);
+int launch_pipeline(Pipeline *pipeline, Job *job);
+int execute_simple_command(SimpleCommand *cmd);
+int run_pipeline(Pipeline *pipeline);
+void execute_command(char *input);
+void run_line(char *line);
+
+// Input
+void line_reader_open(LineReader *reader, int fd);
+void line_reader_open_string(LineReader *reader, char *str);
+void line_reader_close(LineReader *reader);
+char* line_reader_next(LineReader *reader);
+char* reader_input_line(const char *prompt);
+char* readline_input_line(const char *prompt);
+void run_reader(LineReader *reader);
+
+// History
+char* history_default_path(void);
+int history_remap(void);
+void history_scan(void);
+void history_unmap_index(void);
+void history_load_index(void);
+void history_refresh(void);
+long history_count(void);
+const char* history_entry(long i, uint32_t *len);
+uint32_t history_trigram(const unsigned char *p);
+int history_build_index(const char *path, const char *data, size_t size, ino_t inode);
+void history_start_rebuild(void);
+void history_open(void);
+void history_add(const char *line);
+int history_matches(long i, const char *query, size_t query_len);
+long history_find(const char *query, long before);
+int history_search_key(int count, int key);
+int handle_history(char **args, OutBuf *out);
+
+// Record and replay
+int open_record(const char *path);
+void record_line(const char *line);
+char* replay_parse_record(char *record, long long *offset_ns);
+char* replay_input_line(const char *prompt);
+void replay_command_name(const char *line, char *name, size_t size);
+void replay_add_latency(const char *name, long long ns, int status);
+int compare_latencies(const void *a, const void *b);
+int compare_replay_groups(const void *a, const void *b);
+void format_latency(char *buf, size_t size, long long ns);
+void print_replay_row(OutBuf *out, const char *name, const long long *latencies, int count, int failed);
+void print_replay_report(void);
+void finish_replay(void);
+int run_replay(const char *path, double speed);
+
+#endif
@@ -0,0 +1,13 @@
+# Background jobs started with &, and waiting for them by $!
+. "$(dirname "$0")/common.sh"
+
+check "no background job yet" "[]" 'echo [$!]'
+check "\$! is a pid" "1" 'sleep 0 & echo $! | grep -c "^[1-9][0-9]*$"'
+check "wait \$! gives its status" "3" 'sh -c "exit 3" & wait $!; echo $?'
+check "wait \${!} gives its status" "0" 'true & wait ${!}; echo $?'
+check "\$! is the last stage" "5" 'false | sh -c "exit 5" & wait $!; echo $?'
+check "background output" "done" 'echo done & wait'
+check "wait for an unknown pid" "wait: pid 999999 is not a child of this shell
+127" 'wait 999999; echo $?'
+
+finish
@@ -0,0 +1,10 @@
+# The batch builtin, which runs a program on items read from stdin
+. "$(dirname "$0")/common.sh"
+
+check "batch echo" "a b" "printf 'a\nb\n' | batch echo"
+check "fixed arguments come first" "items: a b" "printf 'a\nb\n' | batch echo items:"
+check "NUL-separated items" "a b" "printf 'a\0b\0' | batch -0 echo"
+check "missing program" "batch: no-such-program: command not found
+127" "printf 'a\n' | batch no-such-program; echo \$?"
+
+finish
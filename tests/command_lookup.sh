@@ -0,0 +1,29 @@
+# Finding commands: through PATH, and by absolute or relative path
+. "$(dirname "$0")/common.sh"
+
+printf '#!/bin/sh\necho script ran\n' > script.sh
+chmod +x script.sh
+mkdir sub
+cp script.sh sub/inner.sh
+echo data > data.txt
+
+check "command in PATH" "hi" 'echo hi | cat'
+check "absolute path" "0" '/bin/true; echo $?'
+check "relative path" "script ran" './script.sh'
+check "relative path in a directory" "script ran" 'sub/inner.sh'
+check "relative path in a pipeline" "SCRIPT RAN" './script.sh | tr a-z A-Z'
+check "relative path with fork" "script ran" 'set -o spawn=fork; ./script.sh'
+check "missing command" "missing: command not found
+127" 'missing; echo $?'
+check "missing relative path" "./missing: No such file or directory
+127" './missing; echo $?'
+check "directory path" "./sub: Is a directory
+126" './sub; echo $?'
+check "path to a file that isn't executable" "./data.txt: Permission denied
+126" './data.txt; echo $?'
+check "type of an absolute path" "/bin/sh is /bin/sh" 'type /bin/sh'
+check "type of a relative path" "./script.sh is ./script.sh" 'type ./script.sh'
+check "type of a missing path" "./missing: not found" 'type ./missing'
+check "type of a directory" "./sub: not found" 'type ./sub'
+
+finish
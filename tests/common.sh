@@ -0,0 +1,40 @@
+# Helpers shared by the shell's tests. Each test script is run by ctest as
+#   sh tests/<name>.sh path/to/shell
+# and fails if any check does.
+
+SHELL_UNDER_TEST=$1
+TEST_DIR=$(mktemp -d "${TMPDIR:-/tmp}/shell_test.XXXXXX")
+failures=0
+trap 'rm -rf "$TEST_DIR"' EXIT
+cd "$TEST_DIR" || exit 1
+
+# Function to run a command line in the shell under test and compare its
+# output (stdout and stderr) with what is expected
+check() {
+    name=$1
+    expected=$2
+    actual=$("$SHELL_UNDER_TEST" -c "$3" 2>&1)
+    if [ "$actual" != "$expected" ]; then
+        printf 'FAIL %s\n  expected: %s\n  actual:   %s\n' "$name" "$expected" "$actual"
+        failures=$((failures + 1))
+    fi
+}
+
+# Function to run a script fed to the shell under test on stdin, as
+# 'shell < script', and compare its output with what is expected
+check_stdin_script() {
+    name=$1
+    expected=$2
+    printf '%s\n' "$3" > script.sh
+    actual=$("$SHELL_UNDER_TEST" < script.sh 2>&1)
+    if [ "$actual" != "$expected" ]; then
+        printf 'FAIL %s\n  expected: %s\n  actual:   %s\n' "$name" "$expected" "$actual"
+        failures=$((failures + 1))
+    fi
+}
+
+# Function to report the result; call it last
+finish() {
+    [ "$failures" -eq 0 ] && echo "all checks passed"
+    exit "$((failures > 0))"
+}
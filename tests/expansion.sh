@@ -0,0 +1,17 @@
+# Expansion of variables and special parameters in words
+. "$(dirname "$0")/common.sh"
+
+check "variable" "hi" 'GREETING=hi; echo $GREETING'
+check "braced variable" "hix" 'GREETING=hi; echo ${GREETING}x'
+check "unset variable" "[]" 'echo "[$NO_SUCH_VARIABLE]"'
+check "last status" "1" 'false; echo $?'
+check "unset positional parameter" "ab" 'echo a$1b'
+check "positional parameter takes one digit" "a2b" 'echo a$12b'
+check "quoted positional parameter" "[]" 'echo "[$9]"'
+check "braced positional parameter" "x" 'echo ${1}x'
+check "multi-digit positional parameter" "x" 'echo ${10}x'
+check "shell name" "$SHELL_UNDER_TEST" 'echo $0'
+printf 'echo $0\n' > name.sh
+check "script name" "name.sh" "$SHELL_UNDER_TEST name.sh"
+
+finish
@@ -0,0 +1,11 @@
+# Exit statuses of pipeline stages, including builtins the shell runs itself
+. "$(dirname "$0")/common.sh"
+
+check "all stages succeed" "0 0" 'echo hi | cat > /dev/null; echo ${PIPESTATUS[@]}'
+check "last stage fails" "0 1" 'echo hi | false; echo ${PIPESTATUS[@]}'
+check "output that fits the pipe" "0 0" 'echo hi | true; echo ${PIPESTATUS[@]}'
+check "reader quits before a large output" "141 0" 'echo $(seq 1 100000) | true; echo ${PIPESTATUS[@]}'
+check "reader reads a large output" "588895
+0 0" 'echo $(seq 1 100000) | wc -c; echo ${PIPESTATUS[@]}'
+
+finish
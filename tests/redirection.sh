@@ -0,0 +1,14 @@
+# Redirections, with and without blanks around the operators
+. "$(dirname "$0")/common.sh"
+
+printf 'hello\n' > in.txt
+
+check "spaced <" "hello" 'cat < in.txt'
+check "unspaced cmd<file" "hello" 'cat<in.txt'
+check "unspaced cmd<file>out" "hello" 'cat<in.txt>out.txt; cat out.txt'
+check "unspaced word>file<file" "a" 'echo a>b.txt<in.txt; cat b.txt'
+check "descriptor 0<file" "hello" 'cat 0<in.txt'
+check "here-string" "hs" 'cat<<<hs'
+check "quoted < is a word" "a<b" "echo 'a<b'"
+
+finish
@@ -0,0 +1,21 @@
+# Scripts read from stdin, whose lines commands in the script may consume
+. "$(dirname "$0")/common.sh"
+
+check_stdin_script "lines run in order" "one
+two" 'echo one
+echo two'
+
+check_stdin_script "child consumes the next line" "start
+echo consumed
+end" 'echo start
+head -n1
+echo consumed
+echo end'
+
+check_stdin_script "substitution consumes the next line" "start
+got echo skipped" 'echo start
+line=$(head -n1)
+echo skipped
+echo got $line'
+
+finish